@@ -0,0 +1,23 @@
+;; Allocation throughput and the generational collector: builds lists
+;; of different lifetimes, most of them dead by the next collection.
+
+(defun build (n acc)
+  (if (= n 0)
+      acc
+    (build (- n 1) (cons n acc))))
+
+(defun sum (list acc)
+  (if list
+      (sum (cdr list) (+ acc (car list)))
+    acc))
+
+(define keep (make-vector 64 nil))
+
+(defun churn (i total)
+  (if (= i 0)
+      total
+    (let ((list (build 1000 nil)))
+      (vector-set! keep (- i (* (/ i 64) 64)) list)
+      (churn (- i 1) (+ total (sum list 0))))))
+
+(churn 1000 0)
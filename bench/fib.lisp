@@ -0,0 +1,8 @@
+;; Doubly recursive calls: procedure application and integer arithmetic.
+
+(defun fib (n)
+  (if (< n 2)
+      n
+    (+ (fib (- n 1)) (fib (- n 2)))))
+
+(fib 29)
@@ -0,0 +1,16 @@
+;; Heavy use of the let and defun macros from stdlib.lisp: macro
+;; expansion, environment frames and closures.
+
+(defun step (i acc)
+  (let ((a (+ i 1))
+        (b (* i 2)))
+    (let ((c (- b a))
+          (f (lambda (x) (+ x a))))
+      (+ acc (f c)))))
+
+(defun loop (i acc)
+  (if (= i 0)
+      acc
+    (loop (- i 1) (step i acc))))
+
+(loop 200000 0)
@@ -0,0 +1,31 @@
+;; Counts the solutions of the 9 queens problem: short-lived lists and
+;; closures.
+
+(defun safe (row dist placed)
+  (if placed
+      (if (= (car placed) row)
+          nil
+        (if (= (car placed) (+ row dist))
+            nil
+          (if (= (car placed) (- row dist))
+              nil
+            (safe row (+ dist 1) (cdr placed)))))
+    t))
+
+(defun try-rows (row n placed)
+  (if (> row n)
+      0
+    (+ (if (safe row 1 placed)
+           (queens n (cons row placed))
+         0)
+       (try-rows (+ row 1) n placed))))
+
+(defun length (list)
+  (if list (+ 1 (length (cdr list))) 0))
+
+(defun queens (n placed)
+  (if (= (length placed) n)
+      1
+    (try-rows 1 n placed)))
+
+(queens 9 nil)
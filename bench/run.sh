@@ -0,0 +1,109 @@
+#!/bin/sh
+# Runs the benchmark corpus. For every benchmark it reports the best and
+# the median wall time over several runs, plus the allocations,
+# collections and peak RSS that the interpreter reports with -v. The
+# wall time is the elapsed-us the interpreter reports too, from its
+# start until the program has finished and the heap is collected.
+#
+# Usage: bench/run.sh [-n RUNS] [-l LISP] [-a ARGS] [-o FILE] [-c BASELINE]
+#                     [NAME...]
+#
+#   -n RUNS      runs per benchmark (default 5)
+#   -l LISP      interpreter binary (default ./lisp-opt)
+#   -a ARGS      extra interpreter arguments, e.g. -a --gc-compact
+#   -o FILE      also save the results to FILE
+#   -c BASELINE  compare medians against results saved earlier with -o
+#
+# NAME selects benchmarks by file name without .lisp. The reader
+# benchmark is generated, see gen_reader below. bench/sweep.sh runs the
+# benchmarks that measure scaling.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+runs=5
+lisp=./lisp-opt
+args=
+output=
+baseline=
+
+while getopts n:l:a:o:c: opt; do
+  case $opt in
+    n) runs=$OPTARG ;;
+    l) lisp=$OPTARG ;;
+    a) args=$OPTARG ;;
+    o) output=$OPTARG ;;
+    c) baseline=$OPTARG ;;
+    *) exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Lots of small top-level forms for the reader, then one big nested
+# list that is the program's result, for the printer.
+gen_reader() {
+  awk 'BEGIN {
+    for (i = 0; i < 100000; i++)
+      printf "(quote (entry-%d \"value %d\" %d (a b (c d (e . f))) -%d))\n", i, i, i, i
+    printf "(quote ("
+    for (i = 0; i < 100000; i++)
+      printf "(item %d \"text %d\" (x y)) ", i, i
+    printf "))\n"
+  }' > "$1"
+}
+
+if [ $# -eq 0 ]; then
+  set -- $(ls bench/*.lisp | sed 's|bench/||; s|\.lisp$||') reader
+fi
+
+# Pulls a numeric field out of the -v JSON dump.
+stat() {
+  sed -n "s/^  \"$1\": \([0-9]*\).*/\1/p" "$2"
+}
+
+results=$tmp/results
+printf '# %-12s %10s %10s %12s %8s %10s\n' \
+  benchmark min_ms median_ms allocations gcs rss_kb > "$results"
+
+for name in "$@"; do
+  file=bench/$name.lisp
+
+  if [ "$name" = reader ]; then
+    file=$tmp/reader.lisp
+    gen_reader "$file"
+  fi
+
+  : > "$tmp/times"
+  i=0
+  while [ $i -lt "$runs" ]; do
+    "$lisp" -v $args "$file" > "$tmp/out"
+    echo $(( $(stat elapsed-us "$tmp/out") / 1000 )) >> "$tmp/times"
+    i=$((i + 1))
+  done
+
+  sort -n "$tmp/times" > "$tmp/sorted"
+  min=$(head -n 1 "$tmp/sorted")
+  median=$(sed -n "$(( (runs + 1) / 2 ))p" "$tmp/sorted")
+
+  printf '  %-12s %10d %10d %12d %8d %10d\n' "$name" "$min" "$median" \
+    "$(stat allocations "$tmp/out")" "$(stat collections "$tmp/out")" \
+    $(( $(stat max-rss-bytes "$tmp/out") / 1024 )) >> "$results"
+done
+
+if [ -n "$baseline" ]; then
+  awk 'NR == FNR { if ($1 != "#") base[$1] = $3; next }
+       $1 == "#" { print $0 "   vs_base"; next }
+       { delta = ($1 in base && base[$1] > 0) \
+           ? sprintf("%+8.1f%%", ($3 - base[$1]) * 100 / base[$1]) : "       -"
+         print $0 "  " delta }' "$baseline" "$results"
+else
+  cat "$results"
+fi
+
+if [ -n "$output" ]; then
+  cp "$results" "$output"
+fi
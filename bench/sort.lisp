@@ -0,0 +1,48 @@
+;; Merge sort of a pseudo-random list: allocation of list cells that
+;; mostly die young, and integer comparisons.
+
+(defun mod (a b)
+  (- a (* (/ a b) b)))
+
+(defun random-list (n seed acc)
+  (if (= n 0)
+      acc
+    (random-list (- n 1)
+                 (mod (+ (* seed 1103515245) 12345) 2147483648)
+                 (cons (mod seed 100000) acc))))
+
+(defun split (list a b)
+  (if list
+      (split (cdr list) (cons (car list) b) a)
+    (cons a b)))
+
+(defun merge (a b)
+  (if a
+      (if b
+          (if (< (car b) (car a))
+              (cons (car b) (merge a (cdr b)))
+            (cons (car a) (merge (cdr a) b)))
+        a)
+    b))
+
+(defun merge-sort (list)
+  (if (cdr list)
+      (let ((halves (split list nil nil)))
+        (merge (merge-sort (car halves)) (merge-sort (cdr halves))))
+    list))
+
+(defun sorted (list)
+  (if (cdr list)
+      (if (> (car list) (cadr list))
+          nil
+        (sorted (cdr list)))
+    t))
+
+(defun repeat (n)
+  (if (= n 0)
+      t
+    (if (sorted (merge-sort (random-list 10000 n nil)))
+        (repeat (- n 1))
+      nil)))
+
+(repeat 5)
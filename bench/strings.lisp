@@ -0,0 +1,28 @@
+;; String building: string-append, substring and string-length on
+;; short strings, most of which die young, and strings as hash keys.
+
+(defun mod (a b)
+  (- a (* (/ a b) b)))
+
+(defun digits (i)
+  (if (< i 10)
+      (substring "0123456789" i (+ i 1))
+    (string-append (digits (/ i 10)) (digits (mod i 10)))))
+
+(defun build (i acc)
+  (if (= i 0)
+      acc
+    (build (- i 1)
+           (let ((s (string-append acc "abc" (digits i))))
+             (if (> (string-length s) 64)
+                 (substring s 32)
+               s)))))
+
+(defun keys (i table)
+  (if (= i 0)
+      (hash-count table)
+    (progn
+      (hash-put table (string-append "key-" (digits (mod i 5000))) i)
+      (keys (- i 1) table))))
+
+(list (string-length (build 100000 "")) (keys 50000 (make-hash)))
@@ -0,0 +1,155 @@
+#!/bin/sh
+# Runs the programs in bench/sweep/, which time themselves with
+# (runtime-stats) and print what they measured, over a range of sizes
+# or with and without a flag. Every number shown is the best over
+# several runs.
+#
+# Usage: bench/sweep.sh [-n RUNS] [-l LISP] [-a ARGS] [NAME...]
+#
+#   -n RUNS  runs per measurement (default 3)
+#   -l LISP  interpreter binary (default ./lisp-opt)
+#   -a ARGS  extra interpreter arguments, e.g. -a "--gc-threads 4"
+#
+# NAME is one of cons, walk, reader, startup, lookup, threads and
+# gc-sweep (default all).
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+runs=3
+lisp=./lisp-opt
+args=
+
+while getopts n:l:a: opt; do
+  case $opt in
+    n) runs=$OPTARG ;;
+    l) lisp=$OPTARG ;;
+    a) args=$OPTARG ;;
+    *) exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+  set -- cons walk reader startup lookup threads gc-sweep
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# measure FILE [FLAGS...] [-- NAME VALUE...]
+#
+# Runs FILE with every (define NAME ...) replaced by (define NAME
+# VALUE), and prints the minimum of each number in its result over
+# RUNS runs.
+measure() {
+  file=$1
+  shift
+
+  flags=
+  while [ $# -gt 0 ] && [ "$1" != -- ]; do
+    flags="$flags $1"
+    shift
+  done
+  [ $# -gt 0 ] && shift
+
+  : > "$tmp/defines.sed"
+  while [ $# -gt 0 ]; do
+    echo "s/^(define $1 .*)\$/(define $1 $2)/" >> "$tmp/defines.sed"
+    shift 2
+  done
+  sed -f "$tmp/defines.sed" "$file" > "$tmp/program.lisp"
+
+  : > "$tmp/results"
+  i=0
+  while [ $i -lt "$runs" ]; do
+    "$lisp" $args $flags "$tmp/program.lisp" | tr -d '()' >> "$tmp/results"
+    i=$((i + 1))
+  done
+
+  awk '{ for (i = 1; i <= NF; i++) if (NR == 1 || $i < min[i]) min[i] = $i }
+       END { for (i = 1; i <= NF; i++) printf "%s%s", min[i], i < NF ? " " : "\n" }' \
+    "$tmp/results"
+}
+
+# Top-level forms like the ones in the reader benchmark of run.sh,
+# after a form that defines stat. The program's result is the time
+# it spent reading and evaluating them.
+gen_reader() {
+  {
+    sed -n '/^(defun stat/,/^$/p' bench/sweep/startup.lisp
+    awk 'BEGIN {
+      for (i = 0; i < 200000; i++)
+        printf "(quote (entry-%d \"value %d\" %d (a b (c d (e . f))) -%d))\n", i, i, i, i
+    }'
+    echo "(- (stat 'elapsed-us) (stat 'startup-us))"
+  } > "$1"
+}
+
+for name in "$@"; do
+  case $name in
+    cons)
+      echo "# cons: ns per cons that dies young, against live cells"
+      printf '  %-10s %8s\n' live ns
+      for live in 1000 10000 100000 1000000 10000000; do
+        printf '  %-10s %8s\n' $live \
+          "$(measure bench/sweep/cons.lisp -- live $live)"
+      done
+      ;;
+    walk)
+      echo "# walk: us per walk of a 1M cell list scattered over the heap"
+      printf '  %-14s %8s\n' flags us
+      printf '  %-14s %8s\n' none "$(measure bench/sweep/walk.lisp)"
+      printf '  %-14s %8s\n' --gc-compact \
+        "$(measure bench/sweep/walk.lisp --gc-compact)"
+      ;;
+    reader)
+      gen_reader "$tmp/reader.lisp"
+      bytes=$(wc -c < "$tmp/reader.lisp")
+      us=$(measure "$tmp/reader.lisp")
+      echo "# reader: MB/s reading and evaluating quoted top-level forms"
+      printf '  %-10s %8s %8s\n' bytes us MB/s
+      printf '  %-10s %8s %8s\n' $bytes $us $((bytes / us))
+      ;;
+    startup)
+      "$lisp" $args --save-image "$tmp/stdlib.img" > /dev/null
+      echo "# startup: us until the program starts"
+      printf '  %-14s %8s\n' from us
+      printf '  %-14s %8s\n' stdlib.lisp "$(measure bench/sweep/startup.lisp)"
+      printf '  %-14s %8s\n' image \
+        "$(measure bench/sweep/startup.lisp --load-image "$tmp/stdlib.img")"
+      ;;
+    lookup)
+      echo "# lookup: ns per lookup, against elements"
+      printf '  %-10s %8s %8s %10s %10s\n' size vector hash list alist
+      for size in 10000 100000 1000000; do
+        printf '  %-10s %8s %8s %10s %10s\n' $size \
+          $(measure bench/sweep/lookup.lisp -- size $size)
+      done
+      ;;
+    threads)
+      echo "# threads: us of full collections over a 2M cell heap"
+      printf '  %-10s %10s %10s\n' threads max-pause mark
+      for threads in 1 2 4 8 16; do
+        printf '  %-10s %10s %10s\n' $threads \
+          $(measure bench/sweep/threads.lisp --gc-threads $threads)
+      done
+      ;;
+    gc-sweep)
+      echo "# gc-sweep: GB/s of slab heap covered by full collection sweeps"
+      printf '  %-10s %8s %12s %8s\n' live us bytes GB/s
+      for width in 400 1600 6400; do
+        result=$(measure bench/sweep/gc-sweep.lisp -- width $width)
+        us=${result% *}
+        bytes=${result#* }
+        printf '  %-10s %8s %12s %8s\n' $((width * 1000)) $us $bytes \
+          "$(awk "BEGIN { printf \"%.1f\", $bytes / $us / 1000 }")"
+      done
+      ;;
+    *)
+      echo "Unknown sweep: $name" >&2
+      exit 2
+      ;;
+  esac
+done
@@ -0,0 +1,31 @@
+;; Allocation cost against the size of the live heap. Keeps a list of
+;; live cells, then times conses that die young. Prints nanoseconds
+;; per cons, which should stay flat from a thousand to ten million
+;; live cells.
+
+(define live 1000)
+(define churn 5000000)
+
+(defun stat (name)
+  (let ((table (make-hash)))
+    (map (lambda (pair) (hash-put table (car pair) (cdr pair)))
+         (runtime-stats))
+    (hash-get table name)))
+
+(defun build (n acc)
+  (if (= n 0)
+      acc
+    (build (- n 1) (cons n acc))))
+
+(defun garbage (n)
+  (if (= n 0)
+      t
+    (progn
+      (cons n n)
+      (garbage (- n 1)))))
+
+(define kept (build live nil))
+
+(define start (stat 'elapsed-us))
+(garbage churn)
+(/ (* (- (stat 'elapsed-us) start) 1000) churn)
@@ -0,0 +1,36 @@
+;; Sweep throughput of full collections. Keeps a vector of width lists,
+;; each 1000 cells long, and rebuilds it rounds times, so that about
+;; half of the heap is dead when a full collection sweeps it. Prints
+;; the microseconds spent sweeping slab bitmaps and the slab bytes
+;; covered.
+
+(define width 1600)
+(define rounds 5)
+
+(defun stat (name)
+  (let ((table (make-hash)))
+    (map (lambda (pair) (hash-put table (car pair) (cdr pair)))
+         (runtime-stats))
+    (hash-get table name)))
+
+(define heap (make-vector width nil))
+
+(defun build (n acc)
+  (if (= n 0)
+      acc
+    (build (- n 1) (cons n acc))))
+
+(defun fill (i)
+  (if (< i width)
+      (progn
+        (vector-set! heap i (build 1000 nil))
+        (fill (+ i 1)))))
+
+(defun rebuild (n)
+  (if (> n 0)
+      (progn
+        (fill 0)
+        (rebuild (- n 1)))))
+
+(rebuild rounds)
+(list (stat 'full-sweep-us) (stat 'full-sweep-bytes))
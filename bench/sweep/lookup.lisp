@@ -0,0 +1,84 @@
+;; Lookups in a vector and a hash table against the same lookups in a
+;; list and an association list, with size elements each. Prints
+;; nanoseconds per lookup in that order. A list lookup walks half the
+;; list on average, so those are timed over fewer lookups.
+
+(define size 10000)
+(define lookups 200000)
+(define scans (/ 20000000 size))
+
+(defun stat (name)
+  (let ((table (make-hash)))
+    (map (lambda (pair) (hash-put table (car pair) (cdr pair)))
+         (runtime-stats))
+    (hash-get table name)))
+
+(defun mod (a b)
+  (- a (* (/ a b) b)))
+
+;; Spreads the keys looked up over the whole collection.
+(defun key (i)
+  (mod (* i 2654435761) size))
+
+(define vec (make-vector size 0))
+(define table (make-hash))
+
+(defun fill (i)
+  (if (< i size)
+      (progn
+        (vector-set! vec i i)
+        (hash-put table i i)
+        (fill (+ i 1)))))
+
+(fill 0)
+
+(defun build (n l alist)
+  (if (= n 0)
+      (cons l alist)
+    (build (- n 1) (cons (- n 1) l) (cons (cons (- n 1) (- n 1)) alist))))
+
+(define lists (build size nil nil))
+
+(defun nth (l n)
+  (if (= n 0)
+      (car l)
+    (nth (cdr l) (- n 1))))
+
+(defun assoc (alist k)
+  (if (= (car (car alist)) k)
+      (car alist)
+    (assoc (cdr alist) k)))
+
+(defun vector-loop (i)
+  (if (> i 0)
+      (progn
+        (vector-ref vec (key i))
+        (vector-loop (- i 1)))))
+
+(defun hash-loop (i)
+  (if (> i 0)
+      (progn
+        (hash-get table (key i))
+        (hash-loop (- i 1)))))
+
+(defun list-loop (i)
+  (if (> i 0)
+      (progn
+        (nth (car lists) (key i))
+        (list-loop (- i 1)))))
+
+(defun alist-loop (i)
+  (if (> i 0)
+      (progn
+        (assoc (cdr lists) (key i))
+        (alist-loop (- i 1)))))
+
+(defun ns-per (loop n)
+  (let ((start (stat 'elapsed-us)))
+    (loop n)
+    (/ (* (- (stat 'elapsed-us) start) 1000) n)))
+
+(list (ns-per vector-loop lookups)
+      (ns-per hash-loop lookups)
+      (ns-per list-loop scans)
+      (ns-per alist-loop scans))
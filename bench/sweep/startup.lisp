@@ -0,0 +1,10 @@
+;; Prints the microseconds it took the interpreter to get to this
+;; program: loading stdlib.lisp, or the image given with --load-image.
+
+(defun stat (name)
+  (let ((table (make-hash)))
+    (map (lambda (pair) (hash-put table (car pair) (cdr pair)))
+         (runtime-stats))
+    (hash-get table name)))
+
+(stat 'startup-us)
@@ -0,0 +1,36 @@
+;; Full collections over a wide heap: a vector of width lists, each
+;; length cells long, rebuilt rounds times so that promoted garbage
+;; keeps triggering full collections. Prints the longest pause and the
+;; total mark time in microseconds, to compare --gc-threads settings.
+
+(define width 1000)
+(define length 2000)
+(define rounds 5)
+
+(defun stat (name)
+  (let ((table (make-hash)))
+    (map (lambda (pair) (hash-put table (car pair) (cdr pair)))
+         (runtime-stats))
+    (hash-get table name)))
+
+(define heap (make-vector width nil))
+
+(defun build (n acc)
+  (if (= n 0)
+      acc
+    (build (- n 1) (cons n acc))))
+
+(defun fill (i)
+  (if (< i width)
+      (progn
+        (vector-set! heap i (build length nil))
+        (fill (+ i 1)))))
+
+(defun rebuild (n)
+  (if (> n 0)
+      (progn
+        (fill 0)
+        (rebuild (- n 1)))))
+
+(rebuild rounds)
+(list (stat 'pause-max-us) (stat 'mark-time-us))
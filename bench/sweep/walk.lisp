@@ -0,0 +1,42 @@
+;; List walk speed. The list is built with garbage allocated between
+;; its cells, so its spine is scattered over the heap unless
+;; --gc-compact has moved it into consecutive cells. Prints
+;; microseconds per walk.
+
+(define size 1000000)
+(define walks 20)
+
+(defun stat (name)
+  (let ((table (make-hash)))
+    (map (lambda (pair) (hash-put table (car pair) (cdr pair)))
+         (runtime-stats))
+    (hash-get table name)))
+
+(defun scatter (n acc)
+  (if (= n 0)
+      acc
+    (progn
+      (cons n n)
+      (cons n n)
+      (scatter (- n 1) (cons n acc)))))
+
+(define spine (scatter size nil))
+
+;; Compaction only runs between top-level forms, so a full collection
+;; while spine was built leaves it to the end of the define above.
+
+(defun walk (l sum)
+  (if l
+      (walk (cdr l) (+ sum (car l)))
+    sum))
+
+(defun repeat (n)
+  (if (= n 0)
+      t
+    (progn
+      (walk spine 0)
+      (repeat (- n 1)))))
+
+(define start (stat 'elapsed-us))
+(repeat walks)
+(/ (- (stat 'elapsed-us) start) walks)
@@ -0,0 +1,28 @@
+;; Vectors and hash tables: indexed access and hashed lookups with
+;; integer and string keys.
+
+(define size 20000)
+(define v (make-vector size 0))
+(define h (make-hash))
+
+(defun fill (i)
+  (if (< i size)
+      (progn
+        (vector-set! v i (* i i))
+        (hash-put h i (- size i))
+        (fill (+ i 1)))
+    size))
+
+(defun total (i acc)
+  (if (< i size)
+      (total (+ i 1) (+ acc (vector-ref v i) (hash-get h i 0)))
+    acc))
+
+(defun rounds (n acc)
+  (if (= n 0)
+      acc
+    (progn
+      (fill 0)
+      (rounds (- n 1) (+ acc (total 0 0))))))
+
+(rounds 10 0)
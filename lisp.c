@@ -1,14 +1,52 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <errno.h>
-
-#define SLAB_SIZE 1024
-#define TOKEN_BUF_SIZE 256
-#define GC_THRESHOLD 1
-#define GC_ROOT_STACK_SIZE 1024
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define SLAB_BYTES 65536
+#define SLAB_WORDS 31
+#define SLAB_SIZE (SLAB_WORDS * 64)
+#define GC_DEFAULT_GROWTH 100
+#define GC_DEFAULT_MIN_THRESHOLD 8192
+#define GC_DEFAULT_NURSERY_SIZE 8192
+#define SYMBOL_TABLE_INITIAL_SIZE 1024
+#define NAME_ARENA_CHUNK_SIZE 65536
+#define MACRO_CACHE_INITIAL_SIZE 256
+#define HASH_TABLE_INITIAL_SIZE 16
+#define GC_MARK_STACK_LIMIT (1 << 20)
+#define GC_STRESS_MARK_STACK_LIMIT 64
+#define GC_MAX_THREADS 64
+#define GC_MARK_SHARE_MIN 64
+#define OUTBUF_INITIAL_SIZE 4096
+#define STRING_CHUNK_BYTES 65536
+#define STRING_LARGE_BLOCK (STRING_CHUNK_BYTES / 4)
+#define STRING_HEAP_MIN_THRESHOLD (1 << 20)
+#define PROFILE_INTERVAL_US 1000
+#define PROFILE_MAX_DEPTH 256
+#define PROFILE_BUFFER_SIZE (1 << 16)
+#define PROFILE_TABLE_INITIAL_SIZE 256
+#define GC_PAUSE_BUCKETS 20
+
+// The largest vector whose items, plus the extra byte that keeps
+// malloc() from seeing a zero size, can be allocated without the size
+// computation wrapping around.
+#define VECTOR_MAX_SIZE ((SIZE_MAX - 1) / sizeof(struct value_t*))
 
 enum type_t {
   GUARD = 0,
@@ -18,29 +56,116 @@ enum type_t {
   PROC,
   PRIMITIVE,
   MACRO,
-  STRING
+  STRING,
+  VECTOR,
+  HASH_TABLE,
+  CODE
 };
 
+#define TYPE_COUNT (CODE + 1)
+
 struct value_t;
 
 
-typedef struct value_t* (*primitive_op_t)(struct value_t*);
+// Primitives get their evaluated arguments as a window of the argument
+// stack, see eval_primitive.
+typedef struct value_t* (*primitive_op_t)(size_t argc, struct value_t** argv);
+typedef struct value_t* (*primitive_op1_t)(struct value_t*);
+typedef struct value_t* (*primitive_op2_t)(struct value_t*, struct value_t*);
+
+struct primitive_def_t {
+  const char* name;
+  primitive_op_t op;
+  primitive_op1_t op1;
+  primitive_op2_t op2;
+};
 
 struct cons_t {
   struct value_t* car;
   struct value_t* cdr;
 };
 
+enum special_form_t {
+  NOT_SPECIAL = 0,
+  SPECIAL_QUOTE,
+  SPECIAL_IF,
+  SPECIAL_SETF,
+  SPECIAL_DEFINE,
+  SPECIAL_DEFMACRO,
+  SPECIAL_PROGN,
+  SPECIAL_LAMBDA,
+  SPECIAL_MACROEXPAND
+};
+
 struct symbol_t {
   const char* name;
+  enum special_form_t special_form;
+  struct value_t* global;
 };
 
+// A string is a slice of a string block, see the string heap below.
+// Substrings share the block of the string they were taken from.
+struct string_t {
+  struct string_block_t* block;
+  const char* data;
+  size_t length;
+};
+
+// body is a CODE cell. env is the frame of the procedure the lambda
+// was evaluated in, or toplevel_env.
 struct proc_t {
   struct value_t* params;
   struct value_t* body;
   struct value_t* env;
 };
 
+// Procedure bodies are compiled to bytecode on their first call, see
+// compile_code(). lambda is the (params . body) the bytecode is
+// compiled from. scope lists the frames of the procedures the lambda
+// is nested in, innermost first, each as an association list from
+// symbols to slots.
+struct code_t {
+  struct bytecode_t* bytecode;
+  struct value_t* lambda;
+  struct value_t* scope;
+};
+
+// The first params slots hold the arguments, or with rest set the
+// list of all arguments. The variables defined in the body and the
+// parameters of inline lets get the other slots. stack is the most
+// temporaries the code keeps on the stack at once. The constants are
+// referenced by index from ops, so ops holds no heap pointers. epoch
+// is the macro_epoch the code was compiled under.
+struct bytecode_t {
+  size_t params;
+  int rest;
+  int heap;
+  size_t slots;
+  size_t stack;
+  size_t constant_count;
+  size_t epoch;
+  struct value_t** constants;
+  intptr_t ops[];
+};
+
+struct vector_t {
+  struct value_t** items;
+  size_t size;
+};
+
+// Open addressing with linear probing. Keys are never removed, so an
+// empty slot (key == 0) always ends a probe sequence.
+struct hash_entry_t {
+  struct value_t* key;
+  struct value_t* value;
+};
+
+struct hash_table_t {
+  struct hash_entry_t* entries;
+  size_t capacity;
+  size_t size;
+};
+
 struct value_t {
   enum type_t type;
   char gc_flag;
@@ -50,37 +175,183 @@ struct value_t {
     struct symbol_t symbol;
     struct proc_t proc;
     long int_value;
-    primitive_op_t primitive_op;
-    const char* string_value;
+    const struct primitive_def_t* primitive;
+    struct string_t string;
+    struct vector_t vector;
+    struct hash_table_t hash;
+    struct code_t code;
   };
 };
 
 
+// Slabs are SLAB_BYTES in size and aligned to it, so the slab of a
+// cell is found by masking its address. The GC state of the cells is
+// kept in dense bitmaps at the start of the slab, one bit per cell:
+// whether it is allocated, marked, whether it owns malloc()ed storage
+// that free_value() has to release, and whether --gc-stress has turned
+// it into a GUARD. Collections mostly work on these words and don't
+// touch the cells themselves.
 struct memory_slab_t {
-  struct value_t data[SLAB_SIZE];
-  char used_blocks[SLAB_SIZE];
-  char reachable_blocks[SLAB_SIZE];
+  uint64_t used[SLAB_WORDS];
+  uint64_t marks[SLAB_WORDS];
+  uint64_t finalize[SLAB_WORDS];
+  uint64_t quarantine[SLAB_WORDS];
   struct memory_slab_t* parent;
+  struct value_t data[SLAB_SIZE];
+};
+
+typedef char slab_fits_check[sizeof(struct memory_slab_t) <= SLAB_BYTES ? 1 : -1];
+
+#define SLAB_OF(val) \
+  ((struct memory_slab_t*)((uintptr_t)(val) & ~(uintptr_t)(SLAB_BYTES - 1)))
+
+#define CELL_INDEX(slab, val) \
+  ((size_t)((val) - (slab)->data))
+
+#define BIT_WORD(bitmap, index) \
+  ((bitmap)[(index) >> 6])
+
+#define BIT_MASK(index) \
+  ((uint64_t)1 << ((index) & 63))
+
+struct value_stack_t {
+  struct value_t** data;
+  size_t size;
+  size_t capacity;
 };
 
 size_t number_of_allocations = 0;
 size_t last_allocations = 0;
 
+// Always-on counters, reported by (runtime-stats) and -v. Cells that
+// --gc-stress turns into GUARDs stay in use until their slab is
+// retired.
+size_t allocations_by_type[TYPE_COUNT] = {0};
+size_t cells_in_use = 0;
+size_t slab_count = 0;
+
+// The heap has two generations that share the same slabs. A cell is
+// young until it survives a collection; after that its mark bit stays
+// set ("sticky" mark bits), so a minor collection never traces or
+// sweeps old cells. Young cells are tracked in gc_nursery, and old
+// cells that were mutated to point at young ones are recorded in
+// gc_remembered by gc_write_barrier().
+//
+// The mark itself lives in the slab bitmaps. gc_flag only records
+// whether a cell is in the remembered set, or during compaction that it
+// has been forwarded.
+#define GC_WHITE 0
+#define GC_REMEMBERED 2
+#define GC_FORWARDED 3
+
+struct value_stack_t gc_nursery = {0};
+struct value_stack_t gc_remembered = {0};
+
+// A minor collection runs once gc_nursery_size cells have been
+// allocated. A major one replaces it once the cells promoted since the
+// last major collection exceed gc_growth percent of the cells that
+// survived it, but never fewer than gc_min_threshold.
+long gc_growth = GC_DEFAULT_GROWTH;
+long gc_min_threshold = GC_DEFAULT_MIN_THRESHOLD;
+long gc_nursery_size = GC_DEFAULT_NURSERY_SIZE;
+size_t gc_threshold = GC_DEFAULT_MIN_THRESHOLD;
+size_t gc_live_cells = 0;
+size_t gc_promoted = 0;
+
+size_t gc_collections = 0;
+size_t gc_minor_collections = 0;
+double gc_pause_total = 0;
+double gc_pause_max = 0;
+double gc_mark_time = 0;
+double gc_sweep_time = 0;
+size_t gc_live_after = 0;
+
+// Slab bytes covered by the bitmap sweeps of full collections, and the
+// time they took, for sweep throughput.
+size_t gc_full_sweep_bytes = 0;
+double gc_full_sweep_time = 0;
+
+// Bucket i counts pauses shorter than 2^i microseconds, the last one
+// all longer pauses.
+size_t gc_pause_histogram[GC_PAUSE_BUCKETS] = {0};
+
 struct memory_slab_t* toplevel_slab = 0;
-struct value_t* gc_root_stack[GC_ROOT_STACK_SIZE];
-size_t gc_root_stack_pos = 0;
+
+// Allocation looks for clear bits in the used bitmaps, starting at
+// alloc_slab and moving towards older slabs. Collections free cells
+// anywhere, so they reset it to toplevel_slab.
+struct memory_slab_t* alloc_slab = 0;
+size_t alloc_word = 0;
+
+// Roots are the addresses of the variables that hold heap pointers,
+// so that a copying collection can update them in place.
+//
+// Collections only happen at safe points in eval() and vm_call(),
+// never inside slab_alloc(), so a C variable only has to be rooted if
+// it stays live across a call that can evaluate code. Such variables
+// are registered for the duration of a block with GC_ROOT_SCOPE_BEGIN,
+// GC_ROOT(var) and GC_ROOT_SCOPE_END.
+struct root_stack_t {
+  struct value_t*** data;
+  size_t size;
+  size_t capacity;
+};
+
+struct root_stack_t gc_roots = {0};
+
+// Evaluated arguments of the primitive calls in progress, and the
+// frames and temporaries of the bytecode VM. Every entry is a root.
+struct value_stack_t arg_stack = {0};
+
+#define GC_ROOT_SCOPE_BEGIN \
+  size_t gc_root_scope = gc_roots.size
+
+#define GC_ROOT(var) \
+  gc_root_push(&(var))
+
+#define GC_ROOT_SCOPE_END \
+  gc_root_restore(gc_root_scope)
+
+// --gc-stress collects at every safe point and never reuses freed
+// cells, so that any unrooted pointer still in use runs into a GUARD
+// cell instead of silently aliasing a new object. It also shrinks the
+// mark stack so that its overflow handling gets exercised.
+int gc_stress = 0;
+
+int gc_compacting = 0;
+int gc_compact_pending = 0;
+size_t gc_compactions = 0;
 
 #define DEFSYM(symname) \
   struct value_t* symname##_p = 0;
 
 #define REGISTER_SYMBOL(symname) \
-  symname##_p = slab_alloc(); \
-  *symname##_p = (struct value_t){.type=SYMBOL, .symbol.name = #symname };  \
-  symbols = cons(symname##_p, symbols);
+  symname##_p = intern(#symname); \
+  gc_root_push(&symname##_p);
+
+#define REGISTER_SPECIAL_FORM(symname, form) \
+  REGISTER_SYMBOL(symname); \
+  symname##_p->symbol.special_form = form;
 
 #define CHECK_GUARD(val) \
   if ((val)->type == GUARD) die("Access to deallocated memory");
 
+// Integers that fit into a pointer minus its low bit are stored
+// directly in the pointer with that bit set, and never allocated.
+// Heap cells are always aligned, so their low bit is clear.
+#define FIXNUM_TAG 1
+#define FIXNUM_MIN (INTPTR_MIN >> 1)
+#define FIXNUM_MAX (INTPTR_MAX >> 1)
+
+#define IS_FIXNUM(val) \
+  (((uintptr_t)(val)) & FIXNUM_TAG)
+
+#define FIXNUM_VALUE(val) \
+  (((intptr_t)(val)) >> 1)
+
+#define MAKE_FIXNUM(num) \
+  ((struct value_t*)((((uintptr_t)(num)) << 1) | FIXNUM_TAG))
+
 DEFSYM(nil);
 DEFSYM(t);
 DEFSYM(quote);
@@ -95,12 +366,40 @@ DEFSYM(define);
 DEFSYM(defmacro);
 DEFSYM(macroexpand);
 
-struct value_t *symbols = 0;
+struct symbol_entry_t {
+  size_t hash;
+  struct value_t* symbol;
+};
+
+// Interned symbols live in an open-addressing hash table keyed by name.
+// The table is a GC root, so symbols are never freed and their names
+// can be bump-allocated from name_arena.
+struct symbol_table_t {
+  struct symbol_entry_t* entries;
+  size_t capacity;
+  size_t size;
+};
+
+struct name_arena_t {
+  char* chunk;
+  size_t used;
+};
+
+struct symbol_table_t symbol_table = {0};
+struct name_arena_t name_arena = {0};
 struct value_t *toplevel_env = 0;
-struct value_t *toplevel_code = 0;
 
-char token_buf[TOKEN_BUF_SIZE];
-size_t token_buf_used = 0;
+// Bumped whenever a global starts or stops holding a macro. Bytecode
+// compiled under an older epoch may have expanded the old definition,
+// or compiled a call of what is a macro now, and is compiled again on
+// its next call.
+size_t macro_epoch = 0;
+
+// CODE cells holding bytecode that was replaced by compile_code(). Frames
+// still running it keep pointers into its ops and constants, so it is
+// kept alive until the next top-level safe point, where no frames are
+// left.
+struct value_t *retired_code = 0;
 
 
 int die(const char *format, ...)
@@ -115,48 +414,225 @@ int die(const char *format, ...)
     exit(1);
 }
 
-struct value_t* slab_alloc() {
-  struct memory_slab_t* slab;
-  for (slab = toplevel_slab; slab != 0; slab = slab->parent) {
-    for (size_t i = 0; i<SLAB_SIZE; ++i) {
-      if (slab->used_blocks[i] == 0) {
-        slab->used_blocks[i] = 1;
+void value_stack_push(struct value_stack_t* stack, struct value_t* val) {
+  if (stack->size == stack->capacity) {
+    stack->capacity = stack->capacity ? stack->capacity * 2 : 1024;
+    stack->data = realloc(stack->data,
+                          stack->capacity * sizeof(struct value_t*));
+    if (stack->data == 0)
+      die("Out of memory");
+  }
+
+  stack->data[stack->size++] = val;
+}
+
+// Makes room for count more values without moving the stack again.
+void value_stack_reserve(struct value_stack_t* stack, size_t count) {
+  if (stack->capacity - stack->size >= count)
+    return;
+
+  while (stack->capacity - stack->size < count)
+    stack->capacity = stack->capacity ? stack->capacity * 2 : 1024;
+
+  stack->data = realloc(stack->data, stack->capacity * sizeof(struct value_t*));
+  if (stack->data == 0)
+    die("Out of memory");
+}
+
+struct memory_slab_t* slab_new() {
+  void* slab;
+
+  if (posix_memalign(&slab, SLAB_BYTES, sizeof(struct memory_slab_t)) != 0)
+    die("Out of memory");
+
+  memset(slab, 0, sizeof(struct memory_slab_t));
+  slab_count++;
+  return slab;
+}
+
+void slab_grow() {
+  struct memory_slab_t* new_slab = slab_new();
+  new_slab->parent = toplevel_slab;
+  toplevel_slab = new_slab;
+}
+
+void slab_alloc_reset() {
+  alloc_slab = toplevel_slab;
+  alloc_word = 0;
+}
+
+struct value_t* slab_alloc(enum type_t type) {
+  for (;;) {
+    if (alloc_slab == 0) {
+      slab_grow();
+      slab_alloc_reset();
+    }
+
+    for (; alloc_word < SLAB_WORDS; alloc_word++) {
+      uint64_t free_bits = ~alloc_slab->used[alloc_word];
+
+      if (free_bits != 0) {
+        size_t index = alloc_word * 64 + __builtin_ctzll(free_bits);
+        struct value_t* ret = &alloc_slab->data[index];
+
+        alloc_slab->used[alloc_word] |= BIT_MASK(index);
+
         number_of_allocations++;
         last_allocations++;
-        slab->data[i].gc_flag = 0;
-        return &slab->data[i];
+        allocations_by_type[type]++;
+        cells_in_use++;
+        ret->gc_flag = GC_WHITE;
+        value_stack_push(&gc_nursery, ret);
+        return ret;
       }
     }
+
+    alloc_slab = alloc_slab->parent;
+    alloc_word = 0;
   }
+}
 
-  struct memory_slab_t* new_slab = malloc(sizeof(struct memory_slab_t));
-  memset(new_slab, 0, sizeof(struct memory_slab_t));
-  new_slab->parent = toplevel_slab;
-  toplevel_slab = new_slab;
+int gc_is_marked(struct value_t* val) {
+  if (IS_FIXNUM(val))
+    return 1;
+
+  struct memory_slab_t* slab = SLAB_OF(val);
+  size_t index = CELL_INDEX(slab, val);
+
+  return (BIT_WORD(slab->marks, index) & BIT_MASK(index)) != 0;
+}
+
+// Cells whose type owns malloc()ed storage must be flagged, so that
+// the sweep knows which dead cells to pass to free_value().
+void gc_set_finalize(struct value_t* val) {
+  struct memory_slab_t* slab = SLAB_OF(val);
+  size_t index = CELL_INDEX(slab, val);
+
+  BIT_WORD(slab->finalize, index) |= BIT_MASK(index);
+}
 
-  return slab_alloc();
+int needs_finalize(enum type_t type) {
+  return type == VECTOR || type == HASH_TABLE || type == CODE;
 }
 
 void free_value(struct value_t* val) {
   switch(val->type) {
-  case SYMBOL:
-    free((void*)val->symbol.name);
+  case VECTOR:
+    free(val->vector.items);
     break;
-  case STRING:
-    free((void*)val->string_value);
+  case HASH_TABLE:
+    free(val->hash.entries);
+    break;
+  case CODE:
+    free(val->code.bytecode);
     break;
   case GUARD:
+  case SYMBOL:
   case CONS:
   case INT:
   case PROC:
   case PRIMITIVE:
   case MACRO:
+  case STRING:
     break;
   }
 }
 
+// The characters of strings live in blocks that are bump-allocated
+// from chunks of the string heap. A block starts with its length and
+// is followed by the characters, without a terminating NUL. Chunks are
+// aligned to STRING_CHUNK_BYTES, so the chunk of a block is found by
+// masking its address; blocks bigger than STRING_LARGE_BLOCK get a
+// chunk of their own.
+//
+// Full collections measure how many bytes of every chunk are still
+// referenced, and free the chunks that have none. Chunks that were
+// mostly garbage at the previous full collection are evacuated: the
+// blocks still in use are copied to a fresh chunk as the marker finds
+// them, and the old chunk is freed as a whole. Compaction evacuates
+// every chunk.
+struct string_block_t {
+  size_t length;
+  struct string_block_t* forward;
+  size_t epoch;
+  char data[];
+};
+
+struct string_chunk_t {
+  struct string_chunk_t* next;
+  size_t size;
+  size_t used;
+  size_t live;
+  int measured;
+  int evacuate;
+  char data[];
+};
+
+struct string_heap_t {
+  struct string_chunk_t* chunks;
+  struct string_chunk_t* current;
+  size_t allocated;
+  size_t live;
+  size_t bytes;
+  size_t threshold;
+  size_t epoch;
+  int tracing;
+};
+
+struct string_heap_t string_heap = {.threshold = STRING_HEAP_MIN_THRESHOLD};
+pthread_mutex_t string_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define STRING_CHUNK_OF(block) \
+  ((struct string_chunk_t*)((uintptr_t)(block) & \
+                            ~(uintptr_t)(STRING_CHUNK_BYTES - 1)))
+
+#define STRING_BLOCK_SIZE(length) \
+  ((sizeof(struct string_block_t) + (length) + 7) & ~(size_t)7)
+
+struct string_chunk_t* string_chunk_new(size_t size) {
+  void* chunk;
+
+  if (posix_memalign(&chunk, STRING_CHUNK_BYTES,
+                     sizeof(struct string_chunk_t) + size) != 0)
+    die("Out of memory");
+
+  *(struct string_chunk_t*)chunk = (struct string_chunk_t){
+    .next = string_heap.chunks, .size = size};
+  string_heap.chunks = chunk;
+  string_heap.bytes += sizeof(struct string_chunk_t) + size;
+
+  return chunk;
+}
+
+struct string_block_t* string_block_alloc(size_t length) {
+  size_t size = STRING_BLOCK_SIZE(length);
+  struct string_chunk_t* chunk = string_heap.current;
+
+  if (size > STRING_LARGE_BLOCK)
+    chunk = string_chunk_new(size);
+  else if (chunk == 0 || chunk->used + size > chunk->size)
+    chunk = string_heap.current = string_chunk_new(
+      STRING_CHUNK_BYTES - sizeof(struct string_chunk_t));
+
+  struct string_block_t* block = (void*)(chunk->data + chunk->used);
+
+  chunk->used += size;
+  string_heap.allocated += size;
+
+  *block = (struct string_block_t){.length = length};
+  return block;
+}
+
+struct string_block_t* string_block_new(const char* data, size_t length) {
+  struct string_block_t* block = string_block_alloc(length);
+
+  memcpy(block->data, data, length);
+  return block;
+}
+
+
 struct value_t *cons(struct value_t* car, struct value_t* cdr) {
-  struct value_t *ret = slab_alloc();
+  struct value_t *ret = slab_alloc(CONS);
 
   *ret = (struct value_t){.type = CONS, .cons.car = car, .cons.cdr = cdr};
 
@@ -167,7 +643,16 @@ int is_nil(struct value_t* val) {
   return val == nil_p;
 }
 
+enum type_t type_of(struct value_t* val) {
+  if (IS_FIXNUM(val))
+    return INT;
+
+  return val->type;
+}
+
 struct value_t *car(struct value_t* val) {
+  if (IS_FIXNUM(val))
+    die("Attempt to get car of an integer");
   CHECK_GUARD(val);
 
   if (val == nil_p)
@@ -177,6 +662,8 @@ struct value_t *car(struct value_t* val) {
 }
 
 struct value_t *cdr(struct value_t* val) {
+  if (IS_FIXNUM(val))
+    die("Attempt to get cdr of an integer");
   CHECK_GUARD(val);
 
   if (val == nil_p)
@@ -185,900 +672,4753 @@ struct value_t *cdr(struct value_t* val) {
   return val->cons.cdr;
 }
 
-size_t memory_used() {
-  size_t res = 0;
-  struct memory_slab_t* slab;
-  for (slab = toplevel_slab; slab != 0; slab = slab->parent) {
-    for (size_t i = 0; i < SLAB_SIZE; i++) {
-      if (slab->used_blocks[i] == 1)
-        res++;
-    }
+void slab_free(struct value_t* val) {
+  struct memory_slab_t* slab = SLAB_OF(val);
+  size_t index = CELL_INDEX(slab, val);
+
+  if (index >= SLAB_SIZE || !(BIT_WORD(slab->used, index) & BIT_MASK(index)))
+    die("Can't free memory");
+
+  free_value(val);
+  memset(val, 0, sizeof(struct value_t));
+  BIT_WORD(slab->used, index) &= ~BIT_MASK(index);
+  BIT_WORD(slab->marks, index) &= ~BIT_MASK(index);
+  BIT_WORD(slab->finalize, index) &= ~BIT_MASK(index);
+  cells_in_use--;
+}
+
+void gc_root_push(struct value_t** root) {
+  if (gc_roots.size == gc_roots.capacity) {
+    gc_roots.capacity = gc_roots.capacity ? gc_roots.capacity * 2 : 1024;
+    gc_roots.data = realloc(gc_roots.data,
+                            gc_roots.capacity * sizeof(struct value_t**));
+    if (gc_roots.data == 0)
+      die("Out of memory");
   }
-  return res;
+
+  gc_roots.data[gc_roots.size++] = root;
 }
 
-void slab_free(struct value_t* val) {
-  struct memory_slab_t* slab;
-  for (slab = toplevel_slab; slab != 0; slab = slab->parent) {
-    if (val >= slab->data && val <= &slab->data[SLAB_SIZE]) {
-      size_t pos = (val - slab->data);
-      slab->used_blocks[pos] = 0;
-      free_value(&slab->data[pos]);
-      memset(&slab->data[pos], 0, sizeof(struct value_t));
+void gc_root_restore(size_t size) {
+  if (gc_roots.size < size)
+    die("GC root stack underflow");
 
-      return;
-    }
-  }
+  gc_roots.size = size;
+}
 
-  die("Can't free memory");
+
+void gc_write_barrier(struct value_t* val) {
+  if (val->gc_flag != GC_REMEMBERED && gc_is_marked(val)) {
+    val->gc_flag = GC_REMEMBERED;
+    value_stack_push(&gc_remembered, val);
+  }
 }
 
-void gc_root_push(struct value_t* val) {
-  gc_root_stack[gc_root_stack_pos++] = val;
-  if (gc_root_stack_pos >= GC_ROOT_STACK_SIZE)
-    die("Out of gc root stack");
+// Forgets the remembered set. Used by collections that trace the whole
+// heap anyway.
+void gc_forget_remembered() {
+  for (size_t i = 0; i < gc_remembered.size; i++)
+    gc_remembered.data[i]->gc_flag = GC_WHITE;
+
+  gc_remembered.size = 0;
 }
 
-void gc_root_pop() {
-  gc_root_stack_pos--;
+// For stores into big containers: only a young heap cell can need the
+// container to be remembered, and remembering a large vector makes
+// every minor collection rescan all of it.
+void gc_write_barrier_ref(struct value_t* container, struct value_t* ref) {
+  if (!gc_is_marked(ref))
+    gc_write_barrier(container);
 }
 
+// Marking is iterative: gray cells are kept on a mark stack instead
+// of the C stack, so the depth of a structure doesn't matter. The stack
+// is capped at gc_mark_stack_limit entries. A cell that doesn't fit is
+// still marked, but its children are left for gc_mark_rescan(), which
+// finds them by scanning the heap for marked cells.
+//
+// With --gc-threads N, full collections mark with N markers. Each one
+// works off its private stack and moves half of it to its shared stack
+// whenever that runs dry, so that idle markers can steal from it. Mark
+// bits are then set with an atomic or. Marker 0 is also the one used
+// for serial marking.
+struct gc_marker_t {
+  struct value_stack_t stack;
+  struct value_stack_t shared;
+  size_t shared_size;
+  pthread_mutex_t lock;
+};
+
+struct gc_marker_t gc_markers[GC_MAX_THREADS];
+long gc_threads = 1;
+int gc_mark_parallel = 0;
+int gc_mark_active = 0;
 
-void gc_mark_val(struct value_t* val) {
-  if (val->gc_flag == 1)
+size_t gc_mark_stack_limit = GC_MARK_STACK_LIMIT;
+int gc_mark_overflow = 0;
+
+// Unbound variable slots hold 0.
+void gc_mark_push(struct gc_marker_t* marker, struct value_t* val) {
+  if (val == 0 || IS_FIXNUM(val))
+    return;
+
+  struct memory_slab_t* slab = SLAB_OF(val);
+  size_t index = CELL_INDEX(slab, val);
+  uint64_t* word = &BIT_WORD(slab->marks, index);
+  uint64_t mask = BIT_MASK(index);
+
+  if (gc_mark_parallel) {
+    if (__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask)
+      return;
+  }
+  else {
+    if (*word & mask)
+      return;
+
+    *word |= mask;
+  }
+
+  if (marker->stack.size >= gc_mark_stack_limit) {
+    __atomic_store_n(&gc_mark_overflow, 1, __ATOMIC_RELAXED);
     return;
+  }
+
+  value_stack_push(&marker->stack, val);
+}
 
-  val->gc_flag = 1;
+void string_mark(struct value_t* val);
 
-  struct value_t* tmp;
+void gc_mark_children(struct gc_marker_t* marker, struct value_t* val) {
   switch(val->type) {
   case GUARD:
     die("Access to deallocated memory");
     break;
   case CONS:
-    for (tmp=val; tmp != nil_p; tmp = cdr(tmp)) {
-      if (tmp->type == CONS) {
-        tmp->gc_flag = 1;
-        gc_mark_val(car(tmp));
-      }
-      else {
-        gc_mark_val(tmp);
-        break;
-      }
-    }
+    gc_mark_push(marker, cdr(val));
+    gc_mark_push(marker, car(val));
+    break;
+  case SYMBOL:
+    if (val->symbol.global != 0)
+      gc_mark_push(marker, val->symbol.global);
     break;
   case MACRO:
   case PROC:
-    gc_mark_val(val->proc.params);
-    gc_mark_val(val->proc.body);
-    gc_mark_val(val->proc.env);
+    gc_mark_push(marker, val->proc.params);
+    gc_mark_push(marker, val->proc.body);
+    gc_mark_push(marker, val->proc.env);
+    break;
+  case VECTOR:
+    for (size_t i = 0; i < val->vector.size; i++)
+      gc_mark_push(marker, val->vector.items[i]);
+    break;
+  case HASH_TABLE:
+    for (size_t i = 0; i < val->hash.capacity; i++) {
+      if (val->hash.entries[i].key != 0) {
+        gc_mark_push(marker, val->hash.entries[i].key);
+        gc_mark_push(marker, val->hash.entries[i].value);
+      }
+    }
+    break;
+  case STRING:
+    if (string_heap.tracing)
+      string_mark(val);
+    break;
+  case CODE:
+    gc_mark_push(marker, val->code.lambda);
+    gc_mark_push(marker, val->code.scope);
+    if (val->code.bytecode != 0) {
+      for (size_t i = 0; i < val->code.bytecode->constant_count; i++)
+        gc_mark_push(marker, val->code.bytecode->constants[i]);
+    }
     break;
   default:
     break;
   };
 }
 
-void gc_mark() {
-  for (size_t i=0; i<gc_root_stack_pos; i++) {
-    gc_mark_val(gc_root_stack[i]);
-  }
-}
-
-int need_gc() {
-  return last_allocations > GC_THRESHOLD;
+void gc_mark_process_stack(struct gc_marker_t* marker) {
+  while (marker->stack.size > 0)
+    gc_mark_children(marker, marker->stack.data[--marker->stack.size]);
 }
 
-void gc_sweep() {
+void gc_mark_rescan() {
   struct memory_slab_t* slab;
+
   for (slab = toplevel_slab; slab != 0; slab = slab->parent) {
-    for (size_t i = 0; i < SLAB_SIZE; i++) {
-      if (slab->used_blocks[i] == 1 && slab->data[i].gc_flag == 0) {
-        slab->used_blocks[i] = 0;
-        memset(&slab->data[i], 0, sizeof(struct value_t));
+    for (size_t w = 0; w < SLAB_WORDS; w++) {
+      uint64_t bits = slab->marks[w] & slab->used[w];
+
+      for (; bits != 0; bits &= bits - 1) {
+        gc_mark_children(&gc_markers[0],
+                         &slab->data[w * 64 + __builtin_ctzll(bits)]);
+        gc_mark_process_stack(&gc_markers[0]);
       }
-      else
-        slab->data[i].gc_flag = 0;
     }
   }
-
-  last_allocations = 0;
 }
 
-void collectgarbage() {
-  gc_mark();
-  gc_sweep();
-}
+void gc_mark_drain() {
+  gc_mark_process_stack(&gc_markers[0]);
 
-char *strdup(const char *s) {
-    size_t size = strlen(s) + 1;
-    char *p = malloc(size);
-    if (p) {
-        memcpy(p, s, size);
-    }
-    return p;
+  while (gc_mark_overflow) {
+    gc_mark_overflow = 0;
+    gc_mark_rescan();
+  }
 }
 
-char *ltoa(long val) {
-  char buf[32];
-
-  sprintf(buf, "%li", val);
-  return strdup(buf);
+void gc_mark_val(struct value_t* val) {
+  gc_mark_push(&gc_markers[0], val);
+  gc_mark_drain();
 }
 
+void gc_mark() {
+  for (size_t i=0; i<gc_roots.size; i++) {
+    if (*gc_roots.data[i] != 0)
+      gc_mark_val(*gc_roots.data[i]);
+  }
 
-struct value_t* makeint(long val) {
-  struct value_t *ret = slab_alloc();
-  *ret = (struct value_t){.type = INT, .int_value = val};
+  for (size_t i=0; i<arg_stack.size; i++)
+    gc_mark_val(arg_stack.data[i]);
 
-  return ret;
+  for (size_t i=0; i<symbol_table.capacity; i++) {
+    if (symbol_table.entries[i].symbol != 0)
+      gc_mark_val(symbol_table.entries[i].symbol);
+  }
 }
 
-struct value_t* makesym(const char* name) {
-  struct value_t *ret = slab_alloc();
-  *ret = (struct value_t){.type = SYMBOL, .symbol.name = strdup(name)};
+// Moves the older half of the private stack to the shared one.
+void gc_mark_share(struct gc_marker_t* marker) {
+  size_t half = marker->stack.size / 2;
 
-  return ret;
+  pthread_mutex_lock(&marker->lock);
+  for (size_t i = 0; i < half; i++)
+    value_stack_push(&marker->shared, marker->stack.data[i]);
+  __atomic_store_n(&marker->shared_size, marker->shared.size,
+                   __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&marker->lock);
+
+  memmove(marker->stack.data, marker->stack.data + half,
+          (marker->stack.size - half) * sizeof(struct value_t*));
+  marker->stack.size -= half;
 }
 
-struct value_t* makestring(const char* val) {
-  struct value_t *ret = slab_alloc();
-  *ret = (struct value_t){.type = STRING, .string_value = strdup(val)};
+// Takes half of the first non-empty shared stack, starting with the
+// marker's own.
+int gc_mark_steal(struct gc_marker_t* self) {
+  size_t index = self - gc_markers;
 
-  return ret;
-}
+  for (long i = 0; i < gc_threads; i++) {
+    struct gc_marker_t* victim = &gc_markers[(index + i) % gc_threads];
 
-struct value_t* makeprimitive(primitive_op_t op) {
-  struct value_t *ret = slab_alloc();
-  *ret = (struct value_t){.type = PRIMITIVE, .primitive_op = op};
+    if (__atomic_load_n(&victim->shared_size, __ATOMIC_RELAXED) == 0)
+      continue;
 
-  return ret;
-}
+    pthread_mutex_lock(&victim->lock);
+    size_t take = (victim->shared.size + 1) / 2;
+    for (size_t j = 0; j < take; j++)
+      value_stack_push(&self->stack,
+                       victim->shared.data[--victim->shared.size]);
+    __atomic_store_n(&victim->shared_size, victim->shared.size,
+                     __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&victim->lock);
 
-struct value_t* makeproc(struct value_t* params,
-                         struct value_t* body,
-                         struct value_t * env) {
-  struct value_t *ret = slab_alloc();
-  *ret = (struct value_t){.type = PROC,
-                          .proc.params = params,
-                          .proc.body = body,
-                          .proc.env = env};
+    if (take > 0)
+      return 1;
+  }
 
-  return ret;
+  return 0;
 }
 
-struct value_t* makemacro(struct value_t* params,
-                          struct value_t* body,
-                          struct value_t * env) {
-  struct value_t *ret = makeproc(params, body, env);
-  ret->type = MACRO;
-  return ret;
-}
+// A marker that runs out of work leaves the active count and waits
+// until it can steal again. Only active markers ever have gray cells,
+// so once the count drops to zero marking is done.
+int gc_mark_wait(struct gc_marker_t* self) {
+  __atomic_sub_fetch(&gc_mark_active, 1, __ATOMIC_SEQ_CST);
 
+  for (;;) {
+    for (long i = 0; i < gc_threads; i++) {
+      if (__atomic_load_n(&gc_markers[i].shared_size, __ATOMIC_RELAXED) == 0)
+        continue;
+
+      __atomic_add_fetch(&gc_mark_active, 1, __ATOMIC_SEQ_CST);
+      if (gc_mark_steal(self))
+        return 1;
+      __atomic_sub_fetch(&gc_mark_active, 1, __ATOMIC_SEQ_CST);
+    }
 
-struct value_t *makeenv(struct value_t* parent) {
-  struct value_t *ret = slab_alloc();
-  *ret = (struct value_t){.type = CONS,
-                          .cons.car = nil_p,
-                          .cons.cdr = parent};
-  return ret;
+    if (__atomic_load_n(&gc_mark_active, __ATOMIC_SEQ_CST) == 0)
+      return 0;
+
+    sched_yield();
+  }
 }
 
-long get_int(struct value_t* val) {
-  if (val->type != INT)
-    die("Attempt to get int value of non-integer");
+void* gc_mark_worker(void* arg) {
+  struct gc_marker_t* self = arg;
 
-  return val->int_value;
-}
+  do {
+    while (self->stack.size > 0) {
+      gc_mark_children(self, self->stack.data[--self->stack.size]);
+
+      if (self->stack.size >= GC_MARK_SHARE_MIN &&
+          __atomic_load_n(&self->shared_size, __ATOMIC_RELAXED) == 0)
+        gc_mark_share(self);
+    }
+  } while (gc_mark_steal(self) || gc_mark_wait(self));
 
-struct value_t* find_symbol(const char* name) {
-  struct value_t* sym;
-  for (sym = symbols; !is_nil(sym); sym = cdr(sym)) {
-    if (strcmp(name, car(sym)->symbol.name) == 0)
-      return car(sym);
-  }
   return 0;
 }
 
-struct value_t* intern(const char* name) {
-  struct value_t* sym = find_symbol(name);
+void profile_block(int how, sigset_t* old);
 
-  if (sym != 0)
-    return sym;
+// Runs fn(&tasks[i]) for every thread, on the calling thread for i = 0.
+void gc_run_threads(void* (*fn)(void*), void* tasks, size_t task_size) {
+  pthread_t threads[GC_MAX_THREADS];
+  sigset_t old;
 
-  sym = makesym(name);
+  // Profiling samples are only taken on the main thread, which sits
+  // in a [gc] frame while the others run.
+  profile_block(SIG_BLOCK, &old);
 
-  symbols = cons(sym, symbols);
-  return sym;
-}
+  for (long i = 1; i < gc_threads; i++) {
+    if (pthread_create(&threads[i], 0, fn, (char*)tasks + i * task_size) != 0)
+      die("Can't start gc thread");
+  }
 
+  pthread_sigmask(SIG_SETMASK, &old, 0);
 
+  fn(tasks);
 
-void add_to_token_buf(char c) {
-  token_buf[token_buf_used++] = c;
+  for (long i = 1; i < gc_threads; i++)
+    pthread_join(threads[i], 0);
 }
 
-char* token_buf_to_str() {
-  add_to_token_buf('\0');
-  return token_buf;
-}
+void gc_mark_threads() {
+  size_t n = 0;
 
-char* gettoken(const char** strp) {
-  const char* p = *strp;
-  token_buf_used = 0;
+  gc_mark_parallel = 1;
 
+  for (size_t i=0; i<gc_roots.size; i++) {
+    if (*gc_roots.data[i] != 0)
+      gc_mark_push(&gc_markers[n++ % gc_threads], *gc_roots.data[i]);
+  }
 
-  for (;;) {
-    if (isspace(*p)) {
-      do {
-        if (isspace(*p))
-          ++p;
-      } while(isspace(*p));
-    }
-    else if (*p == ';') {
-      for(;; ++p) {
-        if (*p == '\0')
-          return 0;
+  for (size_t i=0; i<arg_stack.size; i++)
+    gc_mark_push(&gc_markers[n++ % gc_threads], arg_stack.data[i]);
 
-        if (*p == '\n') {
-          p++;
-          break;
-        }
-      }
-    }
-    else if (*p == '\0') {
-      return 0;
-    }
-    else
-      break;
+  for (size_t i=0; i<symbol_table.capacity; i++) {
+    if (symbol_table.entries[i].symbol != 0)
+      gc_mark_push(&gc_markers[n++ % gc_threads],
+                   symbol_table.entries[i].symbol);
   }
 
-  add_to_token_buf(*p);
-  if (*p == '(' || *p == ')' || *p == '\'') {
-    *strp = p+1;
-    return token_buf_to_str();
-  }
+  gc_mark_active = gc_threads;
+  gc_run_threads(gc_mark_worker, gc_markers, sizeof(struct gc_marker_t));
 
-  p++;
+  gc_mark_parallel = 0;
 
-  if (*(p-1) == '"') {
-    for(;; ++p) {
-      if (*p == '\0') {
-        *strp = p;
-        return 0;
-      }
-      add_to_token_buf(*p);
+  // Overflow is recovered from serially.
+  gc_mark_drain();
+}
 
-      if (*p == '"') {
-        *strp = p+1;
-        return token_buf_to_str();
-      }
-    }
+// Starts tracing the string heap for a full collection. New strings
+// go to a fresh chunk, so that only chunks measured by the previous
+// full collection are ever picked for evacuation.
+void string_heap_begin(int evacuate_all) {
+  string_heap.epoch++;
+  string_heap.current = 0;
+  string_heap.tracing = 1;
+
+  for (struct string_chunk_t* chunk = string_heap.chunks; chunk != 0;
+       chunk = chunk->next) {
+    chunk->evacuate =
+      evacuate_all || (chunk->measured && chunk->live * 2 < chunk->used);
+    chunk->live = 0;
   }
+}
 
-  for (;; ++p) {
-    if (*p == '\0') {
-      *strp = p;
+struct string_block_t* string_evacuate(struct string_block_t* block) {
+  if (gc_mark_parallel)
+    pthread_mutex_lock(&string_heap_lock);
 
-      if (token_buf_used == 0)
-        return 0;
+  if (block->forward == 0)
+    block->forward = string_block_new(block->data, block->length);
+
+  struct string_block_t* copy = block->forward;
+
+  if (gc_mark_parallel)
+    pthread_mutex_unlock(&string_heap_lock);
+
+  return copy;
+}
+
+// Called once for every live string during a full collection, from
+// any of the marking threads. Several strings can share a block, the
+// epoch makes sure that it is only counted once.
+void string_mark(struct value_t* val) {
+  struct string_block_t* block = val->string.block;
+
+  if (STRING_CHUNK_OF(block)->evacuate) {
+    struct string_block_t* copy = string_evacuate(block);
+
+    val->string.data = copy->data + (val->string.data - block->data);
+    val->string.block = block = copy;
+  }
+
+  if (__atomic_exchange_n(&block->epoch, string_heap.epoch,
+                          __ATOMIC_RELAXED) != string_heap.epoch)
+    __atomic_add_fetch(&STRING_CHUNK_OF(block)->live,
+                       STRING_BLOCK_SIZE(block->length), __ATOMIC_RELAXED);
+}
+
+// Frees evacuated chunks and chunks without live blocks.
+void string_heap_sweep() {
+  struct string_chunk_t** link = &string_heap.chunks;
+  size_t live = 0;
+
+  while (*link != 0) {
+    struct string_chunk_t* chunk = *link;
+
+    if (chunk->evacuate || chunk->live == 0) {
+      if (chunk == string_heap.current)
+        string_heap.current = 0;
+
+      *link = chunk->next;
+      string_heap.bytes -= sizeof(struct string_chunk_t) + chunk->size;
+      free(chunk);
+      continue;
+    }
+
+    chunk->measured = 1;
+    live += chunk->live;
+    link = &chunk->next;
+  }
+
+  string_heap.live = live;
+  string_heap.allocated = 0;
+  string_heap.tracing = 0;
+}
+
+// Macro expansions are memoized per call site. The cache is keyed on
+// the cons of the macro call and also records which macro produced the
+// expansion, so redefining the macro invalidates it. Entries are weak:
+// an expansion is only kept alive while both its call site and its
+// macro are reachable, and entries whose key or macro died are dropped
+// after marking.
+struct macro_cache_entry_t {
+  struct value_t* form;
+  struct value_t* macro;
+  struct value_t* expansion;
+};
+
+struct macro_cache_t {
+  struct macro_cache_entry_t* entries;
+  size_t capacity;
+  size_t size;
+};
+
+struct macro_cache_t macro_cache = {0};
+
+size_t macro_cache_hash(struct value_t* form) {
+  return ((uintptr_t)form >> 4) * 11400714819323198485UL;
+}
+
+struct macro_cache_entry_t* macro_cache_slot(struct macro_cache_entry_t* entries,
+                                             size_t capacity,
+                                             struct value_t* form) {
+  size_t mask = capacity - 1;
+
+  for (size_t i = macro_cache_hash(form) & mask;; i = (i + 1) & mask) {
+    if (entries[i].form == 0 || entries[i].form == form)
+      return &entries[i];
+  }
+}
+
+// Rehashes the live entries into a table of the given capacity.
+void macro_cache_rebuild(size_t capacity) {
+  struct macro_cache_entry_t* old = macro_cache.entries;
+  size_t old_capacity = macro_cache.capacity;
+
+  macro_cache.entries = calloc(capacity, sizeof(struct macro_cache_entry_t));
+  if (macro_cache.entries == 0)
+    die("Out of memory");
+
+  macro_cache.capacity = capacity;
+  macro_cache.size = 0;
+
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].form == 0)
+      continue;
+
+    *macro_cache_slot(macro_cache.entries, capacity, old[i].form) = old[i];
+    macro_cache.size++;
+  }
+
+  free(old);
+}
+
+struct value_t* macro_cache_get(struct value_t* form, struct value_t* macro) {
+  if (macro_cache.size == 0)
+    return 0;
+
+  struct macro_cache_entry_t* entry =
+    macro_cache_slot(macro_cache.entries, macro_cache.capacity, form);
+
+  if (entry->form == 0 || entry->macro != macro)
+    return 0;
+
+  return entry->expansion;
+}
+
+void macro_cache_put(struct value_t* form, struct value_t* macro,
+                     struct value_t* expansion) {
+  if ((macro_cache.size + 1) * 2 > macro_cache.capacity)
+    macro_cache_rebuild(macro_cache.capacity ? macro_cache.capacity * 2
+                                             : MACRO_CACHE_INITIAL_SIZE);
+
+  struct macro_cache_entry_t* entry =
+    macro_cache_slot(macro_cache.entries, macro_cache.capacity, form);
+
+  if (entry->form == 0)
+    macro_cache.size++;
+
+  *entry = (struct macro_cache_entry_t){form, macro, expansion};
+}
+
+// Marking an expansion can make other call sites reachable, so this
+// runs to a fixpoint. Old cells keep their mark, so during a minor
+// collection entries with an old call site are always kept.
+void macro_cache_mark() {
+  int progress = 1;
+
+  while (progress) {
+    progress = 0;
+
+    for (size_t i = 0; i < macro_cache.capacity; i++) {
+      struct macro_cache_entry_t* entry = &macro_cache.entries[i];
+
+      if (entry->form == 0 || gc_is_marked(entry->expansion) ||
+          !gc_is_marked(entry->form) || !gc_is_marked(entry->macro))
+        continue;
+
+      gc_mark_val(entry->expansion);
+      progress = 1;
+    }
+  }
+}
+
+// Drops entries whose call site or macro is about to be freed.
+void macro_cache_sweep() {
+  size_t dead = 0;
+
+  for (size_t i = 0; i < macro_cache.capacity; i++) {
+    struct macro_cache_entry_t* entry = &macro_cache.entries[i];
+
+    if (entry->form != 0 &&
+        (!gc_is_marked(entry->form) || !gc_is_marked(entry->macro))) {
+      *entry = (struct macro_cache_entry_t){0};
+      dead++;
+    }
+  }
+
+  if (dead > 0) {
+    // Emptied slots can break probe chains, so the survivors have to
+    // be rehashed.
+    macro_cache.size -= dead;
+    macro_cache_rebuild(macro_cache.capacity);
+  }
+}
+
+void macro_cache_clear() {
+  if (macro_cache.capacity > 0)
+    memset(macro_cache.entries, 0,
+           macro_cache.capacity * sizeof(struct macro_cache_entry_t));
+  macro_cache.size = 0;
+}
+
+void gc_update_threshold() {
+  size_t threshold = gc_live_cells * gc_growth / 100;
+
+  if (threshold < (size_t)gc_min_threshold)
+    threshold = gc_min_threshold;
+
+  gc_threshold = threshold;
+
+  threshold = string_heap.live * gc_growth / 100;
+
+  if (threshold < STRING_HEAP_MIN_THRESHOLD)
+    threshold = STRING_HEAP_MIN_THRESHOLD;
+
+  string_heap.threshold = threshold;
+}
+
+// Promoted cells and newly allocated string bytes both count towards
+// the next full collection.
+int gc_need_major() {
+  return gc_promoted > gc_threshold ||
+    string_heap.allocated > string_heap.threshold;
+}
+
+int need_gc() {
+  return gc_stress || last_allocations > (size_t)gc_nursery_size;
+}
+
+// Full collections sweep in slab ranges, one per gc thread.
+struct gc_sweep_task_t {
+  struct memory_slab_t** slabs;
+  size_t count;
+  size_t live;
+};
+
+struct gc_sweep_task_t* gc_sweep_tasks() {
+  static struct gc_sweep_task_t tasks[GC_MAX_THREADS];
+  static struct memory_slab_t** slabs = 0;
+  static size_t capacity = 0;
+  size_t count = 0;
+
+  for (struct memory_slab_t* slab = toplevel_slab; slab != 0;
+       slab = slab->parent) {
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      slabs = realloc(slabs, capacity * sizeof(struct memory_slab_t*));
+      if (slabs == 0)
+        die("Out of memory");
+    }
+
+    slabs[count++] = slab;
+  }
+
+  size_t per_task = (count + gc_threads - 1) / gc_threads;
+
+  for (long i = 0; i < gc_threads; i++) {
+    size_t begin = i * per_task < count ? i * per_task : count;
+    size_t end = begin + per_task < count ? begin + per_task : count;
+
+    tasks[i] = (struct gc_sweep_task_t){.slabs = slabs + begin,
+                                        .count = end - begin};
+  }
+
+  return tasks;
+}
+
+void gc_clear_marks() {
+  struct memory_slab_t* slab;
+
+  for (slab = toplevel_slab; slab != 0; slab = slab->parent)
+    memset(slab->marks, 0, sizeof(slab->marks));
+}
+
+// Frees a dead cell. In --gc-stress mode the cell is turned into a
+// GUARD and stays allocated, so that it is never handed out again. It
+// is also quarantined, so that later sweeps skip it instead of freeing
+// it over and over.
+void gc_free_cell(struct memory_slab_t* slab, size_t index) {
+  struct value_t* val = &slab->data[index];
+
+  if (BIT_WORD(slab->finalize, index) & BIT_MASK(index)) {
+    free_value(val);
+    BIT_WORD(slab->finalize, index) &= ~BIT_MASK(index);
+  }
+
+  if (gc_stress) {
+    memset(val, 0, sizeof(struct value_t));
+    BIT_WORD(slab->quarantine, index) |= BIT_MASK(index);
+  }
+  else {
+    BIT_WORD(slab->used, index) &= ~BIT_MASK(index);
+    cells_in_use--;
+  }
+}
+
+// Works a bitmap word at a time. Only dead cells that own storage, and
+// in --gc-stress mode all newly dead cells, are ever looked at.
+void* gc_sweep_range(void* arg) {
+  struct gc_sweep_task_t* task = arg;
+  size_t live = 0;
+
+  for (size_t s = 0; s < task->count; s++) {
+    struct memory_slab_t* slab = task->slabs[s];
+
+    for (size_t w = 0; w < SLAB_WORDS; w++) {
+      uint64_t dead = slab->used[w] & ~slab->marks[w] & ~slab->quarantine[w];
+
+      if (gc_stress) {
+        for (; dead != 0; dead &= dead - 1)
+          gc_free_cell(slab, w * 64 + __builtin_ctzll(dead));
+      }
+      else {
+        uint64_t finalize = dead & slab->finalize[w];
+
+        for (; finalize != 0; finalize &= finalize - 1)
+          free_value(&slab->data[w * 64 + __builtin_ctzll(finalize)]);
+
+        slab->finalize[w] &= ~dead;
+        slab->used[w] &= ~dead;
+      }
+
+      live += __builtin_popcountll(slab->used[w]);
+    }
+  }
+
+  task->live = live;
+  return 0;
+}
+
+// --gc-stress never reuses a cell, so the heap grows with every
+// allocation. Slabs that hold nothing but GUARDs are moved from the
+// heap to gc_retired_slabs, where collections no longer look at them.
+// This keeps the cost of a collection proportional to the live heap.
+// They stay allocated, so that a stale pointer into them still finds
+// a GUARD.
+struct memory_slab_t* gc_retired_slabs = 0;
+
+void gc_retire_slabs() {
+  struct memory_slab_t** link = &toplevel_slab;
+
+  while (*link != 0) {
+    struct memory_slab_t* slab = *link;
+    size_t w = 0;
+
+    while (w < SLAB_WORDS && slab->quarantine[w] == ~(uint64_t)0)
+      w++;
+
+    if (w < SLAB_WORDS) {
+      link = &slab->parent;
+      continue;
+    }
+
+    *link = slab->parent;
+    slab->parent = gc_retired_slabs;
+    gc_retired_slabs = slab;
+    cells_in_use -= SLAB_SIZE;
+  }
+}
+
+void gc_sweep() {
+  struct gc_sweep_task_t* tasks = gc_sweep_tasks();
+  size_t live = 0;
+
+  gc_run_threads(gc_sweep_range, tasks, sizeof(struct gc_sweep_task_t));
+
+  for (long i = 0; i < gc_threads; i++) {
+    live += tasks[i].live;
+    gc_full_sweep_bytes += tasks[i].count * SLAB_BYTES;
+  }
+
+  gc_live_cells = live;
+  cells_in_use = live;
+
+  if (gc_stress)
+    gc_retire_slabs();
+
+  slab_alloc_reset();
+}
+
+// Only cells allocated since the previous collection can be white
+// here, so sweeping the nursery is enough to free all garbage among
+// them. Survivors keep their mark and become old.
+void gc_sweep_nursery() {
+  for (size_t i = 0; i < gc_nursery.size; i++) {
+    struct value_t* val = gc_nursery.data[i];
+
+    if (gc_is_marked(val))
+      gc_promoted++;
+    else {
+      struct memory_slab_t* slab = SLAB_OF(val);
+      gc_free_cell(slab, CELL_INDEX(slab, val));
+    }
+  }
+
+  slab_alloc_reset();
+}
+
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Set by main(): when the interpreter started, and how long it took to
+// get to the program, loading stdlib.lisp or an image.
+double start_ms = 0;
+double startup_ms = 0;
+
+// --profile samples the Lisp call stack. vm_call() keeps a shadow stack
+// with the names of the procedures and primitives it is in, where a
+// procedure called in tail position replaces its caller, just like on
+// the real stack. On every SIGPROF the stack is copied into
+// profile_samples, and profile_flush() later folds the samples into
+// counts per distinct stack.
+struct profile_stack_t {
+  const char** names;
+  size_t size;
+  size_t capacity;
+};
+
+struct profile_stack_t profile_stack = {0};
+int profiling = 0;
+
+// Samples are stored back to back, each as its frames followed by 0.
+// Stacks deeper than PROFILE_MAX_DEPTH keep their innermost frames.
+const char* profile_samples[PROFILE_BUFFER_SIZE];
+volatile size_t profile_samples_size = 0;
+volatile sig_atomic_t profile_pending = 0;
+volatile size_t profile_dropped = 0;
+
+const char profile_truncated[] = "...";
+
+void profile_block(int how, sigset_t* old) {
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGPROF);
+  pthread_sigmask(how, &mask, old);
+}
+
+void profile_push(const char* name) {
+  if (profile_stack.size == profile_stack.capacity) {
+    sigset_t old;
+
+    // The signal handler must not see the stack while it moves.
+    profile_block(SIG_BLOCK, &old);
+    profile_stack.capacity = profile_stack.capacity
+      ? profile_stack.capacity * 2 : 1024;
+    profile_stack.names = realloc(profile_stack.names,
+                                  profile_stack.capacity * sizeof(char*));
+    if (profile_stack.names == 0)
+      die("Out of memory");
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+  }
+
+  profile_stack.names[profile_stack.size] = name;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  profile_stack.size++;
+}
+
+void profile_pop() {
+  profile_stack.size--;
+}
+
+void profile_signal(int sig) {
+  size_t depth = profile_stack.size;
+  size_t start = depth > PROFILE_MAX_DEPTH ? depth - PROFILE_MAX_DEPTH : 0;
+  size_t pos = profile_samples_size;
+
+  (void)sig;
+
+  if (pos + PROFILE_MAX_DEPTH + 2 > PROFILE_BUFFER_SIZE) {
+    profile_dropped++;
+    return;
+  }
+
+  if (start > 0)
+    profile_samples[pos++] = profile_truncated;
+
+  for (size_t i = start; i < depth; i++)
+    profile_samples[pos++] = profile_stack.names[i];
+
+  profile_samples[pos++] = 0;
+  profile_samples_size = pos;
+
+  if (pos > PROFILE_BUFFER_SIZE / 2)
+    profile_pending = 1;
+}
+
+void profile_timer(long interval) {
+  struct itimerval timer = {{0, interval}, {0, interval}};
+
+  setitimer(ITIMER_PROF, &timer, 0);
+}
+
+void profile_start() {
+  struct sigaction action = {0};
+
+  action.sa_handler = profile_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, 0);
+
+  profiling = 1;
+  profile_timer(PROFILE_INTERVAL_US);
+}
+
+void gc_minor() {
+  double start = now_ms();
+
+  gc_mark();
+
+  for (size_t i = 0; i < gc_remembered.size; i++)
+    gc_mark_children(&gc_markers[0], gc_remembered.data[i]);
+  gc_mark_drain();
+
+  macro_cache_mark();
+
+  double swept = now_ms();
+  gc_mark_time += swept - start;
+
+  macro_cache_sweep();
+  gc_sweep_nursery();
+
+  gc_forget_remembered();
+  gc_sweep_time += now_ms() - swept;
+
+  gc_minor_collections++;
+}
+
+void gc_major() {
+  double start = now_ms();
+
+  gc_forget_remembered();
+  gc_clear_marks();
+  string_heap_begin(0);
+
+  if (gc_threads > 1)
+    gc_mark_threads();
+  else
+    gc_mark();
+
+  macro_cache_mark();
+
+  double swept = now_ms();
+  gc_mark_time += swept - start;
+
+  macro_cache_sweep();
+
+  double sweep_start = now_ms();
+  gc_sweep();
+  gc_full_sweep_time += now_ms() - sweep_start;
+
+  string_heap_sweep();
+  gc_sweep_time += now_ms() - swept;
+
+  gc_promoted = 0;
+  gc_update_threshold();
+
+  if (gc_compacting)
+    gc_compact_pending = 1;
+}
+
+void gc_record_pause(double start) {
+  double pause = now_ms() - start;
+
+  gc_collections++;
+  gc_pause_total += pause;
+  if (pause > gc_pause_max)
+    gc_pause_max = pause;
+
+  size_t bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS - 1 && pause * 1000 >= (1UL << bucket))
+    bucket++;
+  gc_pause_histogram[bucket]++;
+
+  gc_live_after = cells_in_use;
+}
+
+void gc_reset_generations() {
+  gc_nursery.size = 0;
+  gc_remembered.size = 0;
+  last_allocations = 0;
+}
+
+void gc_verify_ref(struct value_t* ref) {
+  if (ref != 0 && !IS_FIXNUM(ref) && ref->type == GUARD)
+    die("Live cell points to a freed cell");
+}
+
+void gc_verify_children(struct value_t* val) {
+  switch(val->type) {
+  case CONS:
+    gc_verify_ref(val->cons.car);
+    gc_verify_ref(val->cons.cdr);
+    break;
+  case SYMBOL:
+    gc_verify_ref(val->symbol.global);
+    break;
+  case MACRO:
+  case PROC:
+    gc_verify_ref(val->proc.params);
+    gc_verify_ref(val->proc.body);
+    gc_verify_ref(val->proc.env);
+    break;
+  case VECTOR:
+    for (size_t i = 0; i < val->vector.size; i++)
+      gc_verify_ref(val->vector.items[i]);
+    break;
+  case HASH_TABLE:
+    for (size_t i = 0; i < val->hash.capacity; i++) {
+      gc_verify_ref(val->hash.entries[i].key);
+      gc_verify_ref(val->hash.entries[i].value);
+    }
+    break;
+  case CODE:
+    gc_verify_ref(val->code.lambda);
+    gc_verify_ref(val->code.scope);
+    if (val->code.bytecode != 0) {
+      for (size_t i = 0; i < val->code.bytecode->constant_count; i++)
+        gc_verify_ref(val->code.bytecode->constants[i]);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// Run after every --gc-stress collection. Every cell that is reachable
+// is marked at this point, so checking the references of all marked
+// cells, in addition to the roots, makes sure that no live object was
+// freed, wherever it is referenced from.
+void gc_verify() {
+  for (size_t i=0; i<gc_roots.size; i++) {
+    struct value_t* root = *gc_roots.data[i];
+
+    if (root != 0 && !IS_FIXNUM(root) && root->type == GUARD)
+      die("GC root points to a freed cell");
+  }
+
+  for (size_t i=0; i<arg_stack.size; i++) {
+    struct value_t* arg = arg_stack.data[i];
+
+    if (arg != 0 && !IS_FIXNUM(arg) && arg->type == GUARD)
+      die("Stack value points to a freed cell");
+  }
+
+  for (struct memory_slab_t* slab = toplevel_slab; slab != 0;
+       slab = slab->parent) {
+    for (size_t w = 0; w < SLAB_WORDS; w++) {
+      uint64_t bits = slab->marks[w] & slab->used[w];
+
+      for (; bits != 0; bits &= bits - 1) {
+        struct value_t* val = &slab->data[w * 64 + __builtin_ctzll(bits)];
+
+        if (val->type == GUARD)
+          die("Live cell was freed");
+
+        gc_verify_children(val);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < macro_cache.capacity; i++) {
+    if (macro_cache.entries[i].form != 0)
+      gc_verify_ref(macro_cache.entries[i].expansion);
+  }
+}
+
+void collectgarbage() {
+  double start = now_ms();
+  int major = gc_need_major();
+
+  if (profiling)
+    profile_push("[gc]");
+
+  // Alternate between both kinds of collections when stress testing,
+  // so that the write barrier gets exercised as well.
+  if (gc_stress)
+    major = gc_collections % 2;
+
+  if (major)
+    gc_major();
+  else
+    gc_minor();
+
+  gc_reset_generations();
+  gc_record_pause(start);
+
+  if (profiling)
+    profile_pop();
+
+  if (gc_stress)
+    gc_verify();
+}
+
+void collectgarbage_full() {
+  double start = now_ms();
+
+  gc_major();
+
+  gc_reset_generations();
+  gc_record_pause(start);
+}
+
+// Copying collection used in --gc-compact mode. Live cells are copied
+// into fresh slabs Cheney-style, except that the whole cdr spine of a
+// list is copied right behind its head, so lists end up in consecutive
+// cells. Every pointer held by C code must be reachable through the
+// root stack for this to be safe, so it only runs at top-level safe
+// points (see gc_toplevel_safepoint).
+struct memory_slab_t** gc_tospace = 0;
+size_t gc_tospace_slabs = 0;
+size_t gc_tospace_capacity = 0;
+size_t gc_tospace_used = 0;
+
+struct value_t* gc_tospace_alloc() {
+  if (gc_tospace_slabs == 0 || gc_tospace_used == SLAB_SIZE) {
+    if (gc_tospace_slabs == gc_tospace_capacity) {
+      gc_tospace_capacity = gc_tospace_capacity ? gc_tospace_capacity * 2 : 64;
+      gc_tospace = realloc(gc_tospace,
+                           gc_tospace_capacity * sizeof(struct memory_slab_t*));
+      if (gc_tospace == 0)
+        die("Out of memory");
+    }
+
+    gc_tospace[gc_tospace_slabs++] = slab_new();
+    gc_tospace_used = 0;
+  }
+
+  struct memory_slab_t* slab = gc_tospace[gc_tospace_slabs-1];
+  size_t index = gc_tospace_used++;
+
+  // Copies are old: allocated and marked.
+  BIT_WORD(slab->used, index) |= BIT_MASK(index);
+  BIT_WORD(slab->marks, index) |= BIT_MASK(index);
+
+  return &slab->data[index];
+}
+
+struct value_t* gc_forward(struct value_t* val) {
+  struct value_t* ret = gc_tospace_alloc();
+
+  *ret = *val;
+  ret->gc_flag = GC_WHITE;
+
+  if (needs_finalize(ret->type))
+    gc_set_finalize(ret);
+
+  val->gc_flag = GC_FORWARDED;
+  val->cons.car = ret;
+
+  return ret;
+}
+
+struct value_t* gc_copy(struct value_t* val) {
+  if (val == 0 || IS_FIXNUM(val))
+    return val;
+
+  if (val->gc_flag == GC_FORWARDED)
+    return val->cons.car;
+
+  CHECK_GUARD(val);
+
+  struct value_t* ret = gc_forward(val);
+  struct value_t* tail = ret;
+
+  // The copy still points at the old cdr, gc_scavenge() fixes that up.
+  while (tail->type == CONS) {
+    struct value_t* next = tail->cons.cdr;
+
+    if (IS_FIXNUM(next) ||
+        next->type != CONS ||
+        next->gc_flag == GC_FORWARDED)
+      break;
+
+    tail = gc_forward(next);
+  }
+
+  return ret;
+}
+
+void hash_table_rehash(struct value_t* table, size_t capacity);
+
+void gc_scavenge(struct value_t* val) {
+  switch(val->type) {
+  case CONS:
+    val->cons.car = gc_copy(val->cons.car);
+    val->cons.cdr = gc_copy(val->cons.cdr);
+    break;
+  case SYMBOL:
+    if (val->symbol.global != 0)
+      val->symbol.global = gc_copy(val->symbol.global);
+    break;
+  case MACRO:
+  case PROC:
+    val->proc.params = gc_copy(val->proc.params);
+    val->proc.body = gc_copy(val->proc.body);
+    val->proc.env = gc_copy(val->proc.env);
+    break;
+  case VECTOR:
+    for (size_t i = 0; i < val->vector.size; i++)
+      val->vector.items[i] = gc_copy(val->vector.items[i]);
+    break;
+  case HASH_TABLE:
+    for (size_t i = 0; i < val->hash.capacity; i++) {
+      if (val->hash.entries[i].key != 0) {
+        val->hash.entries[i].key = gc_copy(val->hash.entries[i].key);
+        val->hash.entries[i].value = gc_copy(val->hash.entries[i].value);
+      }
+    }
+    // Some keys are hashed by address, and addresses have changed.
+    hash_table_rehash(val, val->hash.capacity);
+    break;
+  case STRING:
+    string_mark(val);
+    break;
+  case CODE:
+    val->code.lambda = gc_copy(val->code.lambda);
+    val->code.scope = gc_copy(val->code.scope);
+    if (val->code.bytecode != 0) {
+      for (size_t i = 0; i < val->code.bytecode->constant_count; i++)
+        val->code.bytecode->constants[i] =
+          gc_copy(val->code.bytecode->constants[i]);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+void gc_compact() {
+  gc_tospace_slabs = 0;
+  gc_forget_remembered();
+  string_heap_begin(1);
+
+  // The cache is keyed on addresses, which are about to change.
+  macro_cache_clear();
+
+  for (size_t i=0; i<gc_roots.size; i++) {
+    if (*gc_roots.data[i] != 0)
+      *gc_roots.data[i] = gc_copy(*gc_roots.data[i]);
+  }
+
+  for (size_t i=0; i<arg_stack.size; i++)
+    arg_stack.data[i] = gc_copy(arg_stack.data[i]);
+
+  for (size_t i=0; i<symbol_table.capacity; i++) {
+    if (symbol_table.entries[i].symbol != 0)
+      symbol_table.entries[i].symbol = gc_copy(symbol_table.entries[i].symbol);
+  }
+
+  size_t scan_slab = 0;
+  size_t scan_pos = 0;
+
+  while (scan_slab < gc_tospace_slabs - 1 || scan_pos < gc_tospace_used) {
+    if (scan_pos == SLAB_SIZE) {
+      scan_slab++;
+      scan_pos = 0;
+      continue;
+    }
+
+    gc_scavenge(&gc_tospace[scan_slab]->data[scan_pos++]);
+  }
+
+  while (toplevel_slab != 0) {
+    struct memory_slab_t* parent = toplevel_slab->parent;
+
+    // Storage of copied cells now belongs to the copies.
+    for (size_t w = 0; w < SLAB_WORDS; w++) {
+      uint64_t bits = toplevel_slab->finalize[w] & toplevel_slab->used[w];
+
+      for (; bits != 0; bits &= bits - 1) {
+        struct value_t* val =
+          &toplevel_slab->data[w * 64 + __builtin_ctzll(bits)];
+
+        if (val->gc_flag != GC_FORWARDED)
+          free_value(val);
+      }
+    }
+
+    free(toplevel_slab);
+    slab_count--;
+    toplevel_slab = parent;
+  }
+
+  for (size_t i = 0; i < gc_tospace_slabs; i++) {
+    gc_tospace[i]->parent = toplevel_slab;
+    toplevel_slab = gc_tospace[i];
+  }
+
+  slab_alloc_reset();
+  string_heap_sweep();
+
+  gc_live_cells = (gc_tospace_slabs - 1) * SLAB_SIZE + gc_tospace_used;
+  cells_in_use = gc_live_cells;
+  gc_promoted = 0;
+  gc_update_threshold();
+
+  gc_compact_pending = 0;
+  gc_compactions++;
+}
+
+// Called between top-level forms, where the root stack describes every
+// live pointer. In --gc-compact mode this is where full collections
+// are done by copying; nested ones stay non-moving and only request a
+// compaction at the next top-level safe point.
+void gc_toplevel_safepoint() {
+  retired_code = nil_p;
+
+  if (gc_compacting && (gc_compact_pending || gc_need_major())) {
+    double start = now_ms();
+
+    if (profiling)
+      profile_push("[gc]");
+
+    gc_compact();
+
+    gc_reset_generations();
+    gc_record_pause(start);
+
+    if (profiling)
+      profile_pop();
+  }
+  else if (need_gc()) {
+    collectgarbage();
+  }
+}
+
+struct value_t* makeint(long val) {
+  if (val >= FIXNUM_MIN && val <= FIXNUM_MAX)
+    return MAKE_FIXNUM(val);
+
+  struct value_t *ret = slab_alloc(INT);
+  *ret = (struct value_t){.type = INT, .int_value = val};
+
+  return ret;
+}
+
+struct value_t* makesym(const char* name) {
+  struct value_t *ret = slab_alloc(SYMBOL);
+  *ret = (struct value_t){.type = SYMBOL, .symbol.name = name};
+
+  return ret;
+}
+
+struct value_t* makestring_block(struct string_block_t* block,
+                                 const char* data, size_t len) {
+  struct value_t *ret = slab_alloc(STRING);
+  *ret = (struct value_t){.type = STRING,
+                          .string.block = block,
+                          .string.data = data,
+                          .string.length = len};
+
+  return ret;
+}
+
+struct value_t* makestring_len(const char* val, size_t len) {
+  struct string_block_t* block = string_block_new(val, len);
+
+  return makestring_block(block, block->data, len);
+}
+
+struct value_t* makestring(const char* val) {
+  return makestring_len(val, strlen(val));
+}
+
+struct value_t* makevector(size_t size, struct value_t* fill) {
+  if (size > VECTOR_MAX_SIZE)
+    die("Vector too large: %zu", size);
+
+  struct value_t** items = malloc(size * sizeof(struct value_t*) + 1);
+
+  if (items == 0)
+    die("Out of memory");
+
+  for (size_t i = 0; i < size; i++)
+    items[i] = fill;
+
+  struct value_t *ret = slab_alloc(VECTOR);
+  *ret = (struct value_t){.type = VECTOR,
+                          .vector.items = items,
+                          .vector.size = size};
+  gc_set_finalize(ret);
+
+  return ret;
+}
+
+struct value_t* makehash() {
+  struct hash_entry_t* entries = calloc(HASH_TABLE_INITIAL_SIZE,
+                                        sizeof(struct hash_entry_t));
+
+  if (entries == 0)
+    die("Out of memory");
+
+  struct value_t *ret = slab_alloc(HASH_TABLE);
+  *ret = (struct value_t){.type = HASH_TABLE,
+                          .hash.entries = entries,
+                          .hash.capacity = HASH_TABLE_INITIAL_SIZE};
+  gc_set_finalize(ret);
+
+  return ret;
+}
+
+struct value_t* makeprimitive(const struct primitive_def_t* primitive) {
+  struct value_t *ret = slab_alloc(PRIMITIVE);
+  *ret = (struct value_t){.type = PRIMITIVE, .primitive = primitive};
+
+  return ret;
+}
+
+struct value_t* makecode(struct value_t* lambda, struct value_t* scope) {
+  struct value_t *ret = slab_alloc(CODE);
+  *ret = (struct value_t){.type = CODE,
+                          .code.lambda = lambda,
+                          .code.scope = scope};
+  gc_set_finalize(ret);
+
+  return ret;
+}
+
+struct value_t* makeproc(struct value_t* params,
+                         struct value_t* body,
+                         struct value_t * env) {
+  struct value_t *ret = slab_alloc(PROC);
+  *ret = (struct value_t){.type = PROC,
+                          .proc.params = params,
+                          .proc.body = body,
+                          .proc.env = env};
+
+  return ret;
+}
+
+struct value_t* makemacro(struct value_t* params,
+                          struct value_t* body,
+                          struct value_t * env) {
+  struct value_t *ret = slab_alloc(MACRO);
+  *ret = (struct value_t){.type = MACRO,
+                          .proc.params = params,
+                          .proc.body = body,
+                          .proc.env = env};
+
+  return ret;
+}
+
+
+long get_int(struct value_t* val) {
+  if (IS_FIXNUM(val))
+    return FIXNUM_VALUE(val);
+
+  if (val->type != INT)
+    die("Attempt to get int value of non-integer");
+
+  return val->int_value;
+}
+
+const char* name_arena_dup(const char* name, size_t len) {
+  char* ret;
+
+  if (len + 1 > NAME_ARENA_CHUNK_SIZE / 4) {
+    ret = malloc(len + 1);
+  }
+  else {
+    if (name_arena.chunk == 0 ||
+        name_arena.used + len + 1 > NAME_ARENA_CHUNK_SIZE) {
+      name_arena.chunk = malloc(NAME_ARENA_CHUNK_SIZE);
+      name_arena.used = 0;
+    }
+
+    ret = name_arena.chunk + name_arena.used;
+    name_arena.used += len + 1;
+  }
+
+  if (ret == 0)
+    die("Out of memory");
+
+  memcpy(ret, name, len);
+  ret[len] = '\0';
+  return ret;
+}
+
+size_t hash_name(const char* name, size_t len) {
+  size_t hash = 14695981039346656037UL;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 1099511628211UL;
+  }
+
+  return hash;
+}
+
+struct symbol_entry_t* symbol_table_slot(const char* name, size_t len,
+                                         size_t hash) {
+  size_t mask = symbol_table.capacity - 1;
+
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    struct symbol_entry_t* entry = &symbol_table.entries[i];
+
+    if (entry->symbol == 0)
+      return entry;
+
+    const char* entry_name = entry->symbol->symbol.name;
+    if (entry->hash == hash &&
+        memcmp(entry_name, name, len) == 0 &&
+        entry_name[len] == '\0')
+      return entry;
+  }
+}
+
+void symbol_table_grow() {
+  struct symbol_entry_t* old = symbol_table.entries;
+  size_t old_capacity = symbol_table.capacity;
+
+  symbol_table.capacity = old_capacity ? old_capacity * 2
+                                       : SYMBOL_TABLE_INITIAL_SIZE;
+  symbol_table.entries = calloc(symbol_table.capacity,
+                                sizeof(struct symbol_entry_t));
+  if (symbol_table.entries == 0)
+    die("Out of memory");
+
+  size_t mask = symbol_table.capacity - 1;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].symbol == 0)
+      continue;
+
+    size_t j = old[i].hash & mask;
+    while (symbol_table.entries[j].symbol != 0)
+      j = (j + 1) & mask;
+    symbol_table.entries[j] = old[i];
+  }
+
+  free(old);
+}
+
+struct value_t* intern_len(const char* name, size_t len) {
+  size_t hash = hash_name(name, len);
+
+  if ((symbol_table.size + 1) * 2 > symbol_table.capacity)
+    symbol_table_grow();
+
+  struct symbol_entry_t* entry = symbol_table_slot(name, len, hash);
+
+  if (entry->symbol != 0)
+    return entry->symbol;
+
+  entry->hash = hash;
+  entry->symbol = makesym(name_arena_dup(name, len));
+  symbol_table.size++;
+
+  return entry->symbol;
+}
+
+struct value_t* intern(const char* name) {
+  return intern_len(name, strlen(name));
+}
+
+// Hash table keys compare like eq, except that strings and integers
+// compare by value. Symbols and strings are hashed by name, so their
+// hash doesn't depend on where they live.
+size_t hash_value(struct value_t* key) {
+  uintptr_t bits = (uintptr_t)key;
+
+  if (!IS_FIXNUM(key)) {
+    switch(key->type) {
+    case SYMBOL:
+      return hash_name(key->symbol.name, strlen(key->symbol.name));
+    case STRING:
+      return hash_name(key->string.data, key->string.length);
+    case INT:
+      bits = key->int_value;
+      break;
+    default:
+      bits >>= 4;
+      break;
+    }
+  }
+
+  return bits * 11400714819323198485UL;
+}
+
+int hash_equal(struct value_t* a, struct value_t* b) {
+  if (a == b)
+    return 1;
+
+  if (IS_FIXNUM(a) || IS_FIXNUM(b) || a->type != b->type)
+    return 0;
+
+  if (a->type == INT)
+    return a->int_value == b->int_value;
+
+  if (a->type == STRING)
+    return a->string.length == b->string.length &&
+      memcmp(a->string.data, b->string.data, a->string.length) == 0;
+
+  return 0;
+}
+
+struct hash_entry_t* hash_table_slot(struct hash_entry_t* entries,
+                                     size_t capacity,
+                                     struct value_t* key) {
+  size_t mask = capacity - 1;
+
+  for (size_t i = hash_value(key) & mask;; i = (i + 1) & mask) {
+    if (entries[i].key == 0 || hash_equal(entries[i].key, key))
+      return &entries[i];
+  }
+}
+
+void hash_table_rehash(struct value_t* table, size_t capacity) {
+  struct hash_entry_t* old = table->hash.entries;
+  size_t old_capacity = table->hash.capacity;
+  struct hash_entry_t* entries = calloc(capacity, sizeof(struct hash_entry_t));
+
+  if (entries == 0)
+    die("Out of memory");
+
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].key != 0)
+      *hash_table_slot(entries, capacity, old[i].key) = old[i];
+  }
+
+  free(old);
+  table->hash.entries = entries;
+  table->hash.capacity = capacity;
+}
+
+struct value_t* hash_table_get(struct value_t* table, struct value_t* key) {
+  struct hash_entry_t* entry = hash_table_slot(table->hash.entries,
+                                               table->hash.capacity, key);
+
+  return entry->key != 0 ? entry->value : 0;
+}
+
+void hash_table_put(struct value_t* table, struct value_t* key,
+                    struct value_t* value) {
+  if ((table->hash.size + 1) * 2 > table->hash.capacity)
+    hash_table_rehash(table, table->hash.capacity * 2);
+
+  struct hash_entry_t* entry = hash_table_slot(table->hash.entries,
+                                               table->hash.capacity, key);
+
+  if (entry->key == 0) {
+    entry->key = key;
+    table->hash.size++;
+  }
+
+  entry->value = value;
+  gc_write_barrier_ref(table, key);
+  gc_write_barrier_ref(table, value);
+}
+
+
+// The reader works on an explicit [pos, end) window, so the source
+// doesn't have to be NUL-terminated and can be mmap()ed directly.
+struct reader_t {
+  const char* pos;
+  const char* end;
+};
+
+// Tokens are slices of the source buffer. Nothing is copied until a
+// string or symbol is actually built, so literals can be of any length.
+struct token_t {
+  const char* start;
+  size_t len;
+};
+
+int token_is(struct token_t* tok, char c) {
+  return tok->len == 1 && tok->start[0] == c;
+}
+
+// Returns 0 at the end of input.
+int gettoken(struct reader_t* in, struct token_t* tok) {
+  const char* p = in->pos;
+  const char* end = in->end;
+
+  for (;;) {
+    if (p == end) {
+      in->pos = p;
+      return 0;
+    }
+
+    if (isspace(*p)) {
+      ++p;
+    }
+    else if (*p == ';') {
+      while (p != end && *p != '\n')
+        ++p;
+    }
+    else
+      break;
+  }
+
+  const char* start = p++;
+
+  if (*start == '"') {
+    while (p != end && *p != '"')
+      ++p;
+
+    if (p == end)
+      die("Unterminated string");
+
+    ++p;
+  }
+  else if (*start != '(' && *start != ')' && *start != '\'') {
+    while (p != end &&
+           *p != '(' &&
+           *p != ')' &&
+           *p != ';' &&
+           *p != '\'' &&
+           !isspace(*p))
+      ++p;
+  }
+
+  tok->start = start;
+  tok->len = p - start;
+  in->pos = p;
+  return 1;
+}
+
+// Accepts an optional sign followed by decimal digits. Like strtol,
+// out-of-range values saturate.
+int parse_number(struct token_t* tok, long* result) {
+  const char* p = tok->start;
+  const char* end = p + tok->len;
+  int negative = 0;
+  unsigned long limit = LONG_MAX;
+  unsigned long value = 0;
+
+  if (*p == '-' || *p == '+') {
+    negative = (*p == '-');
+    ++p;
+  }
+
+  if (p == end)
+    return 0;
+
+  if (negative)
+    limit = (unsigned long)LONG_MAX + 1;
+
+  for (; p != end; ++p) {
+    if (*p < '0' || *p > '9')
+      return 0;
+
+    unsigned long digit = *p - '0';
+    if (value > (limit - digit) / 10)
+      value = limit;
+    else
+      value = value * 10 + digit;
+  }
+
+  if (negative)
+    *result = value == limit ? LONG_MIN : -(long)value;
+  else
+    *result = value;
+
+  return 1;
+}
+
+// Lists that are still being read, innermost last, as pairs of their
+// head and last cell. A quote that is waiting for the object it applies
+// to is pushed as a pair of zeros. Keeping them on the heap instead of
+// the C stack means that nesting depth, like list length, is only
+// bounded by memory.
+//
+// The reader never evaluates anything, so it can't reach a GC safe
+// point and doesn't need to root the lists it is building.
+struct value_stack_t reader_stack = {0};
+
+struct value_t* readatom(struct token_t* tok) {
+  long number;
+
+  if (tok->start[0] == '"')
+    return makestring_len(tok->start + 1, tok->len - 2);
+
+  if (parse_number(tok, &number))
+    return makeint(number);
+
+  return intern_len(tok->start, tok->len);
+}
+
+// Reads the list or quoted object that tok opens.
+struct value_t* readlist(struct reader_t* in, struct token_t* tok) {
+  size_t base = reader_stack.size;
+  struct value_t* obj;
+
+  for (;;) {
+    if (token_is(tok, '(') || token_is(tok, '\'')) {
+      struct value_t* open = token_is(tok, '(') ? nil_p : 0;
+
+      value_stack_push(&reader_stack, open);
+      value_stack_push(&reader_stack, open);
+    }
+    else {
+      if (token_is(tok, ')')) {
+        if (reader_stack.size == base ||
+            reader_stack.data[reader_stack.size - 2] == 0)
+          die("Unexpected ')'");
+
+        obj = reader_stack.data[reader_stack.size - 2];
+        reader_stack.size -= 2;
+      }
+      else
+        obj = readatom(tok);
+
+      // The object is complete: apply the quotes in front of it, then
+      // add it to the enclosing list, if there is one.
+      for (;;) {
+        if (reader_stack.size == base)
+          return obj;
+
+        struct value_t** open = &reader_stack.data[reader_stack.size - 2];
+
+        if (open[0] != 0)
+          break;
+
+        reader_stack.size -= 2;
+        obj = cons(quote_p, cons(obj, nil_p));
+      }
+
+      struct value_t** open = &reader_stack.data[reader_stack.size - 2];
+      struct value_t* cell = cons(obj, nil_p);
+
+      if (open[0] == nil_p)
+        open[0] = cell;
+      else
+        open[1]->cons.cdr = cell;
+
+      open[1] = cell;
+    }
+
+    if (!gettoken(in, tok)) {
+      if (reader_stack.data[reader_stack.size - 2] == 0)
+        die("Unexpected end of input after quote");
+
+      die("Malformed list");
+    }
+  }
+}
+
+struct value_t* readobj_token(struct reader_t* in, struct token_t* tok) {
+  if (token_is(tok, '(') || token_is(tok, '\''))
+    return readlist(in, tok);
+
+  if (token_is(tok, ')'))
+    die("Unexpected ')'");
+
+  return readatom(tok);
+}
+
+// Returns 0 (not nil) when there is nothing left to read, so that a
+// literal nil can still be told apart from the end of input.
+struct value_t* readobj(struct reader_t* in) {
+  struct token_t tok;
+
+  if (!gettoken(in, &tok))
+    return 0;
+
+  return readobj_token(in, &tok);
+}
+
+
+// Printer output goes through an outbuf_t. It either accumulates into
+// a growable string, or, when file is set, is flushed to that file
+// whenever the buffer fills up.
+struct outbuf_t {
+  char* data;
+  size_t size;
+  size_t capacity;
+  FILE* file;
+};
+
+void outbuf_flush(struct outbuf_t* out) {
+  if (out->file != 0 && out->size > 0) {
+    fwrite(out->data, 1, out->size, out->file);
+    out->size = 0;
+  }
+}
+
+void outbuf_write(struct outbuf_t* out, const char* str, size_t len) {
+  if (out->size + len + 1 > out->capacity) {
+    outbuf_flush(out);
+
+    if (out->size + len + 1 > out->capacity) {
+      size_t capacity = out->capacity ? out->capacity : OUTBUF_INITIAL_SIZE;
+      while (out->size + len + 1 > capacity)
+        capacity *= 2;
+
+      out->data = realloc(out->data, capacity);
+      if (out->data == 0)
+        die("Out of memory");
+      out->capacity = capacity;
+    }
+  }
+
+  memcpy(out->data + out->size, str, len);
+  out->size += len;
+  out->data[out->size] = '\0';
+}
+
+void outbuf_puts(struct outbuf_t* out, const char* str) {
+  outbuf_write(out, str, strlen(str));
+}
+
+// The printer keeps what is left to print of every open list, vector
+// and hash table on print_stack instead of recursing, so deeply nested
+// structures don't overflow the C stack.
+enum print_task_kind_t {
+  PRINT_VALUE,
+  PRINT_TEXT,
+  PRINT_LIST_REST,
+  PRINT_ITEMS,
+  PRINT_ENTRIES
+};
+
+struct print_task_t {
+  enum print_task_kind_t kind;
+  struct value_t* obj;
+  size_t index;
+  const char* text;
+};
+
+struct print_stack_t {
+  struct print_task_t* data;
+  size_t size;
+  size_t capacity;
+};
+
+struct print_stack_t print_stack = {0};
+
+void print_push(enum print_task_kind_t kind, struct value_t* obj,
+                size_t index, const char* text) {
+  if (print_stack.size == print_stack.capacity) {
+    print_stack.capacity = print_stack.capacity ? print_stack.capacity * 2
+                                                : 1024;
+    print_stack.data = realloc(print_stack.data,
+                               print_stack.capacity *
+                               sizeof(struct print_task_t));
+    if (print_stack.data == 0)
+      die("Out of memory");
+  }
+
+  print_stack.data[print_stack.size++] =
+    (struct print_task_t){kind, obj, index, text};
+}
+
+void print_atom(struct outbuf_t* out, struct value_t* obj) {
+  char buf[32];
+
+  switch(type_of(obj)){
+  case STRING:
+    outbuf_puts(out, "\"");
+    outbuf_write(out, obj->string.data, obj->string.length);
+    outbuf_puts(out, "\"");
+    break;
+  case SYMBOL:
+    outbuf_puts(out, obj->symbol.name);
+    break;
+  case INT:
+    outbuf_write(out, buf, sprintf(buf, "%li", get_int(obj)));
+    break;
+  case PROC:
+    outbuf_puts(out, "#<PROC>");
+    break;
+  case PRIMITIVE:
+    outbuf_puts(out, "#<PRIMITIVE>");
+    break;
+  case MACRO:
+    outbuf_puts(out, "#<MACRO>");
+    break;
+  case CODE:
+    outbuf_puts(out, "#<CODE>");
+    break;
+  case CONS:
+  case VECTOR:
+  case HASH_TABLE:
+    // Printed by print_to().
+    break;
+  case GUARD:
+    die("Access to deallocated memory");
+    break;
+  }
+}
+
+// Lists are printed an element at a time: PRINT_LIST_REST holds the
+// rest of the list after the element being printed. Vectors and hash
+// tables are printed from index on, and a hash table's first printed
+// entry has text set.
+void print_to(struct outbuf_t* out, struct value_t* obj) {
+  size_t base = print_stack.size;
+
+  print_push(PRINT_VALUE, obj, 0, 0);
+
+  while (print_stack.size > base) {
+    struct print_task_t task = print_stack.data[--print_stack.size];
+
+    obj = task.obj;
+
+    switch(task.kind) {
+    case PRINT_TEXT:
+      outbuf_puts(out, task.text);
+      break;
+
+    case PRINT_LIST_REST:
+      if (obj == nil_p)
+        outbuf_puts(out, ")");
+      else if (type_of(obj) != CONS) {
+        outbuf_puts(out, " . ");
+        print_push(PRINT_TEXT, 0, 0, ")");
+        print_push(PRINT_VALUE, obj, 0, 0);
+      }
+      else {
+        outbuf_puts(out, " ");
+        print_push(PRINT_LIST_REST, cdr(obj), 0, 0);
+        print_push(PRINT_VALUE, car(obj), 0, 0);
+      }
+      break;
+
+    case PRINT_ITEMS:
+      if (task.index == obj->vector.size) {
+        outbuf_puts(out, ")");
+        break;
+      }
+
+      if (task.index > 0)
+        outbuf_puts(out, " ");
+      print_push(PRINT_ITEMS, obj, task.index + 1, 0);
+      print_push(PRINT_VALUE, obj->vector.items[task.index], 0, 0);
+      break;
+
+    case PRINT_ENTRIES: {
+      size_t i = task.index;
+
+      while (i < obj->hash.capacity && obj->hash.entries[i].key == 0)
+        i++;
+
+      if (i == obj->hash.capacity) {
+        outbuf_puts(out, ")");
+        break;
+      }
+
+      outbuf_puts(out, task.text ? "(" : " (");
+      print_push(PRINT_ENTRIES, obj, i + 1, 0);
+      print_push(PRINT_TEXT, 0, 0, ")");
+      print_push(PRINT_VALUE, obj->hash.entries[i].value, 0, 0);
+      print_push(PRINT_TEXT, 0, 0, " . ");
+      print_push(PRINT_VALUE, obj->hash.entries[i].key, 0, 0);
+      break;
+    }
+
+    case PRINT_VALUE:
+      switch(type_of(obj)) {
+      case CONS:
+        outbuf_puts(out, "(");
+        print_push(PRINT_LIST_REST, cdr(obj), 0, 0);
+        print_push(PRINT_VALUE, car(obj), 0, 0);
+        break;
+      case VECTOR:
+        outbuf_puts(out, "#(");
+        print_push(PRINT_ITEMS, obj, 0, 0);
+        break;
+      case HASH_TABLE:
+        outbuf_puts(out, "#hash(");
+        print_push(PRINT_ENTRIES, obj, 0, "");
+        break;
+      default:
+        print_atom(out, obj);
+        break;
+      }
+      break;
+    }
+  }
+}
+
+void print_file(FILE* file, struct value_t* obj) {
+  struct outbuf_t out = {0};
+  out.file = file;
+
+  print_to(&out, obj);
+  outbuf_flush(&out);
+  free(out.data);
+}
+
+// Prints an association list as a JSON object, one key per line at the
+// top level. Values that are association lists themselves become
+// nested objects.
+void print_json(struct outbuf_t* out, struct value_t* obj, int depth) {
+  if (type_of(obj) != CONS || type_of(car(obj)) != CONS) {
+    print_to(out, obj);
+    return;
+  }
+
+  outbuf_puts(out, depth == 0 ? "{\n  " : "{");
+
+  for (; obj != nil_p; obj = cdr(obj)) {
+    outbuf_puts(out, "\"");
+    print_to(out, car(car(obj)));
+    outbuf_puts(out, "\": ");
+    print_json(out, cdr(car(obj)), depth + 1);
+
+    if (cdr(obj) != nil_p)
+      outbuf_puts(out, depth == 0 ? ",\n  " : ", ");
+  }
+
+  outbuf_puts(out, depth == 0 ? "\n}" : "}");
+}
+
+void print_json_file(FILE* file, struct value_t* obj) {
+  struct outbuf_t out = {0};
+  out.file = file;
+
+  print_json(&out, obj, 0);
+  outbuf_flush(&out);
+  free(out.data);
+}
+
+// Sample counts per stack, keyed by the stack in collapsed form:
+// frames from the outermost one, separated by ';'.
+struct profile_entry_t {
+  char* stack;
+  size_t hash;
+  size_t count;
+};
+
+struct profile_table_t {
+  struct profile_entry_t* entries;
+  size_t capacity;
+  size_t size;
+};
+
+struct profile_table_t profile_table = {0};
+
+struct profile_entry_t* profile_table_slot(struct profile_entry_t* entries,
+                                           size_t capacity,
+                                           const char* stack, size_t hash) {
+  size_t mask = capacity - 1;
+
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    if (entries[i].stack == 0 ||
+        (entries[i].hash == hash && strcmp(entries[i].stack, stack) == 0))
+      return &entries[i];
+  }
+}
+
+void profile_table_grow() {
+  size_t capacity = profile_table.capacity ? profile_table.capacity * 2
+                                           : PROFILE_TABLE_INITIAL_SIZE;
+  struct profile_entry_t* entries = calloc(capacity,
+                                           sizeof(struct profile_entry_t));
+
+  if (entries == 0)
+    die("Out of memory");
+
+  for (size_t i = 0; i < profile_table.capacity; i++) {
+    struct profile_entry_t* entry = &profile_table.entries[i];
+
+    if (entry->stack != 0)
+      *profile_table_slot(entries, capacity, entry->stack, entry->hash) =
+        *entry;
+  }
+
+  free(profile_table.entries);
+  profile_table.entries = entries;
+  profile_table.capacity = capacity;
+}
+
+void profile_count(const char* stack, size_t len) {
+  if ((profile_table.size + 1) * 2 > profile_table.capacity)
+    profile_table_grow();
+
+  size_t hash = hash_name(stack, len);
+  struct profile_entry_t* entry =
+    profile_table_slot(profile_table.entries, profile_table.capacity,
+                       stack, hash);
+
+  if (entry->stack == 0) {
+    entry->stack = strdup(stack);
+    if (entry->stack == 0)
+      die("Out of memory");
+    entry->hash = hash;
+    profile_table.size++;
+  }
+
+  entry->count++;
+}
+
+void profile_flush() {
+  struct outbuf_t key = {0};
+  sigset_t old;
+
+  profile_block(SIG_BLOCK, &old);
+
+  for (size_t pos = 0; pos < profile_samples_size; pos++) {
+    key.size = 0;
+    outbuf_puts(&key, "toplevel");
+
+    for (; profile_samples[pos] != 0; pos++) {
+      outbuf_puts(&key, ";");
+      outbuf_puts(&key, profile_samples[pos]);
+    }
+
+    profile_count(key.data, key.size);
+  }
+
+  profile_samples_size = 0;
+  profile_pending = 0;
+
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+  free(key.data);
+}
+
+// Writes the collapsed stacks, one "stack count" line each, as read by
+// flamegraph.pl and compatible tools.
+void profile_write(const char* filename) {
+  profile_timer(0);
+  profile_flush();
+
+  FILE* f = fopen(filename, "w");
+  if (f == NULL)
+    die("Error opening file '%s': %s\n", filename, strerror(errno));
+
+  for (size_t i = 0; i < profile_table.capacity; i++) {
+    struct profile_entry_t* entry = &profile_table.entries[i];
+
+    if (entry->stack != 0)
+      fprintf(f, "%s %zu\n", entry->stack, entry->count);
+  }
+
+  if (ferror(f) || fclose(f) != 0)
+    die("Error writing profile '%s'\n", filename);
+
+  if (profile_dropped > 0)
+    fprintf(stderr, "profile: %zu samples dropped\n", profile_dropped);
+}
+
+// Toplevel bindings aren't kept in toplevel_env itself: every symbol
+// points straight at its global (symbol . value) cell, so looking up a
+// global never walks an association list. Local variables never get
+// here, the compiler turns them into frame slots.
+void set_global(struct value_t* cell, struct value_t* value) {
+  if (type_of(cell->cons.cdr) == MACRO || type_of(value) == MACRO)
+    macro_epoch++;
+
+  cell->cons.cdr = value;
+  gc_write_barrier(cell);
+}
+
+void define_global(struct value_t* symbol, struct value_t* value) {
+  struct value_t* cell = symbol->symbol.global;
+
+  if (cell != 0)
+    set_global(cell, value);
+  else {
+    if (type_of(value) == MACRO)
+      macro_epoch++;
+
+    symbol->symbol.global = cons(symbol, value);
+    gc_write_barrier(symbol);
+  }
+}
+
+struct value_t* eval(struct value_t* val);
+struct value_t* vm_call(size_t argc, const char* name);
+
+// Procedures have no names of their own, so frames are named after the
+// symbol they were called through.
+const char* profile_name(struct value_t* head, const char* anonymous) {
+  return type_of(head) == SYMBOL ? head->symbol.name : anonymous;
+}
+
+// Primitives read their arguments in place, from the window of
+// arg_stack they were evaluated onto.
+struct value_t* call_primitive(const struct primitive_def_t* primitive,
+                               size_t argc, struct value_t** argv) {
+  struct value_t* res;
+
+  if (profiling)
+    profile_push(primitive->name);
+
+  if (argc == 2 && primitive->op2)
+    res = primitive->op2(argv[0], argv[1]);
+  else if (argc == 1 && primitive->op1)
+    res = primitive->op1(argv[0]);
+  else
+    res = primitive->op(argc, argv);
+
+  if (profiling)
+    profile_pop();
+
+  return res;
+}
+
+// Calls proc with the elements of args, unevaluated, as arguments.
+struct value_t* apply_list(struct value_t* proc, struct value_t* args,
+                           const char* name) {
+  size_t base = arg_stack.size;
+
+  value_stack_push(&arg_stack, proc);
+  for (; args != nil_p; args = cdr(args))
+    value_stack_push(&arg_stack, car(args));
+
+  return vm_call(arg_stack.size - base - 1, name);
+}
+
+// Expands a macro call. The expansion is cached per call site, see
+// macro_cache_get().
+struct value_t* macroexpand_form(struct value_t* form,
+                                 struct value_t* macro) {
+  struct value_t* expansion = macro_cache_get(form, macro);
+
+  if (expansion == 0) {
+    GC_ROOT_SCOPE_BEGIN;
+    GC_ROOT(form);
+    GC_ROOT(macro);
+    expansion = apply_list(macro, cdr(form), profile_name(car(form), "macro"));
+    GC_ROOT_SCOPE_END;
+
+    macro_cache_put(form, macro, expansion);
+  }
+
+  return expansion;
+}
+
+// Procedure bodies are compiled to bytecode for vm_call() on their
+// first call. Variables are resolved at compile time: a variable of the
+// procedure itself becomes a slot of its frame, a variable of an
+// enclosing procedure a (depth, slot) pair into the chain of heap
+// frames, and anything else a global, looked up through its symbol
+// when the code runs. Macro calls are expanded at compile time, and
+// the code is compiled again on its next call once a macro has been
+// defined or redefined since (see macro_epoch).
+//
+// Frames live on arg_stack, unless the procedure creates closures:
+// then its slots are kept in a heap frame instead, a vector whose item
+// 0 is the frame of the enclosing procedure, so that closures can
+// outlive the call. A lambda that is applied on the spot, which is
+// what let expands to, is compiled inline, and its parameters become
+// slots of the enclosing frame.
+//
+// Operands follow their opcode in ops. Names are constant indices of
+// symbols, for error messages and the profiler; a call through
+// anything but a symbol has -1 instead.
+enum opcode_t {
+  OP_CONST,       // k
+  OP_LOCAL,       // slot name
+  OP_SET_LOCAL,   // slot
+  OP_FRAME,       // depth slot name
+  OP_SET_FRAME,   // depth slot
+  OP_GLOBAL,      // name
+  OP_GLOBAL_CELL, // k of the (symbol . value) cell
+  OP_SET_GLOBAL,  // name
+  OP_POP,
+  OP_JUMP,        // target
+  OP_JUMP_IF_NIL, // target
+  OP_CLOSURE,     // k of a CODE cell
+  OP_CALL,        // argc name
+  OP_TAIL_CALL,   // argc name
+  OP_ADD,         // cell name
+  OP_SUB,         // cell name
+  OP_MUL,         // cell name
+  OP_LESS,        // cell name
+  OP_GREATER,     // cell name
+  OP_EQUALS,      // cell name
+  OP_RETURN,
+  OP_APPLY,
+  OP_EVAL,        // k of a toplevel form
+  OP_ERROR        // k of the message
+};
+
+struct value_t* primitive_plus2(struct value_t* a, struct value_t* b);
+struct value_t* primitive_minus2(struct value_t* a, struct value_t* b);
+struct value_t* primitive_mul2(struct value_t* a, struct value_t* b);
+struct value_t* primitive_less2(struct value_t* a, struct value_t* b);
+struct value_t* primitive_greater2(struct value_t* a, struct value_t* b);
+struct value_t* primitive_equals2(struct value_t* a, struct value_t* b);
+
+// Calls of these primitives with two arguments get an opcode of their
+// own, which does the arithmetic inline when both are fixnums. They are
+// calls otherwise, and when the global no longer holds the primitive.
+struct compile_fixnum_op_t {
+  primitive_op2_t op2;
+  enum opcode_t op;
+};
+
+const struct compile_fixnum_op_t compile_fixnum_ops[] = {
+  {primitive_plus2, OP_ADD},
+  {primitive_minus2, OP_SUB},
+  {primitive_mul2, OP_MUL},
+  {primitive_less2, OP_LESS},
+  {primitive_greater2, OP_GREATER},
+  {primitive_equals2, OP_EQUALS}
+};
+
+struct compile_binding_t {
+  struct value_t* symbol;
+  size_t slot;
+};
+
+// The variables of a procedure body or of an inline lambda. Later
+// bindings shadow earlier ones.
+struct compile_scope_t {
+  struct compile_scope_t* parent;
+  struct compile_binding_t* bindings;
+  size_t size;
+  size_t capacity;
+};
+
+// Constants are collected on arg_stack from index constants up, where
+// they stay rooted while macro expansions run.
+struct compiler_t {
+  struct value_t* outer;
+  struct compile_scope_t* scope;
+  intptr_t* ops;
+  size_t size;
+  size_t capacity;
+  size_t constants;
+  size_t slots;
+  size_t depth;
+  size_t max_depth;
+  int heap;
+  int closures;
+};
+
+enum compile_ref_kind_t {
+  REF_LOCAL,
+  REF_FRAME,
+  REF_GLOBAL
+};
+
+struct compile_ref_t {
+  enum compile_ref_kind_t kind;
+  size_t depth;
+  size_t slot;
+};
+
+void compile_emit(struct compiler_t* c, intptr_t word) {
+  if (c->size == c->capacity) {
+    c->capacity = c->capacity ? c->capacity * 2 : 64;
+    c->ops = realloc(c->ops, c->capacity * sizeof(intptr_t));
+    if (c->ops == 0)
+      die("Out of memory");
+  }
+
+  c->ops[c->size++] = word;
+}
+
+// Emits an opcode that changes the number of temporaries on the stack
+// by effect.
+void compile_op(struct compiler_t* c, enum opcode_t op, int effect) {
+  compile_emit(c, op);
+
+  if (effect < 0 && c->depth < (size_t)-effect)
+    die("Compiler stack underflow");
+
+  c->depth += effect;
+
+  if (c->depth > c->max_depth)
+    c->max_depth = c->depth;
+}
+
+size_t compile_constant(struct compiler_t* c, struct value_t* val) {
+  for (size_t i = c->constants; i < arg_stack.size; i++) {
+    if (arg_stack.data[i] == val)
+      return i - c->constants;
+  }
+
+  value_stack_push(&arg_stack, val);
+  return arg_stack.size - 1 - c->constants;
+}
+
+size_t compile_declare(struct compiler_t* c, struct value_t* symbol) {
+  struct compile_scope_t* scope = c->scope;
+
+  if (scope->size == scope->capacity) {
+    scope->capacity = scope->capacity ? scope->capacity * 2 : 8;
+    scope->bindings = realloc(scope->bindings,
+                              scope->capacity * sizeof(struct compile_binding_t));
+    if (scope->bindings == 0)
+      die("Out of memory");
+  }
+
+  scope->bindings[scope->size++] = (struct compile_binding_t){symbol, c->slots};
+  return c->slots++;
+}
+
+// The slot of a variable of the innermost scope, which is where
+// define puts new variables.
+size_t compile_define_slot(struct compiler_t* c, struct value_t* symbol) {
+  struct compile_scope_t* scope = c->scope;
+
+  for (size_t i = scope->size; i > 0; i--) {
+    if (scope->bindings[i - 1].symbol == symbol)
+      return scope->bindings[i - 1].slot;
+  }
+
+  return compile_declare(c, symbol);
+}
+
+struct compile_ref_t compile_local_ref(struct compiler_t* c, size_t slot) {
+  return (struct compile_ref_t){c->heap ? REF_FRAME : REF_LOCAL, 0, slot};
+}
+
+struct compile_ref_t compile_resolve(struct compiler_t* c,
+                                     struct value_t* symbol) {
+  for (struct compile_scope_t* scope = c->scope; scope != 0;
+       scope = scope->parent) {
+    for (size_t i = scope->size; i > 0; i--) {
+      if (scope->bindings[i - 1].symbol == symbol)
+        return compile_local_ref(c, scope->bindings[i - 1].slot);
+    }
+  }
+
+  size_t depth = c->heap ? 1 : 0;
+
+  for (struct value_t* frame = c->outer; frame != nil_p;
+       frame = cdr(frame), depth++) {
+    struct value_t* entry;
+
+    for (entry = car(frame); entry != nil_p; entry = cdr(entry)) {
+      if (car(car(entry)) == symbol)
+        return (struct compile_ref_t){REF_FRAME, depth,
+                                      FIXNUM_VALUE(cdr(car(entry)))};
+    }
+  }
+
+  return (struct compile_ref_t){REF_GLOBAL, 0, 0};
+}
+
+// The macro that a form with this head expands, if any. Variables
+// shadow global macros.
+struct value_t* compile_macro(struct compiler_t* c, struct value_t* head) {
+  if (type_of(head) != SYMBOL || head->symbol.global == 0)
+    return 0;
+
+  struct value_t* val = cdr(head->symbol.global);
+
+  if (type_of(val) != MACRO || compile_resolve(c, head).kind != REF_GLOBAL)
+    return 0;
+
+  return val;
+}
+
+// ((lambda (params...) body...) args...) with one argument for every
+// parameter.
+int compile_is_inline(struct value_t* form) {
+  struct value_t* head = car(form);
+
+  if (type_of(head) != CONS || car(head) != lambda_p)
+    return 0;
+
+  struct value_t* params = car(cdr(head));
+  struct value_t* args = cdr(form);
+
+  for (; type_of(params) == CONS && type_of(args) == CONS;
+       params = cdr(params), args = cdr(args)) {
+    if (type_of(car(params)) != SYMBOL)
+      return 0;
+  }
+
+  return params == nil_p && args == nil_p;
+}
+
+// Declares the variables that form defines, so that they are visible
+// to the whole body, closures created before the define included.
+// Lambdas have scopes of their own and aren't looked into, and neither
+// are the bodies of inline lambdas.
+void compile_scan(struct compiler_t* c, struct value_t* form) {
+  if (type_of(form) != CONS)
+    return;
+
+  struct value_t* head = car(form);
+  enum special_form_t special = NOT_SPECIAL;
+  struct value_t* macro;
+
+  if (type_of(head) == SYMBOL)
+    special = head->symbol.special_form;
+
+  switch (special) {
+  case SPECIAL_DEFINE: {
+    struct value_t* sym = car(cdr(form));
+
+    if (sym != nil_p && type_of(sym) == SYMBOL)
+      compile_define_slot(c, sym);
+
+    compile_scan(c, car(cdr(cdr(form))));
+    return;
+  }
+
+  case SPECIAL_IF:
+  case SPECIAL_PROGN:
+    break;
+
+  case NOT_SPECIAL:
+    if ((macro = compile_macro(c, head)) != 0) {
+      compile_scan(c, macroexpand_form(form, macro));
+      return;
+    }
+
+    if (!compile_is_inline(form))
+      compile_scan(c, head);
+    break;
+
+  default:
+    return;
+  }
+
+  for (form = cdr(form); type_of(form) == CONS; form = cdr(form))
+    compile_scan(c, car(form));
+}
+
+void compile_form(struct compiler_t* c, struct value_t* form, int tail);
+
+void compile_const(struct compiler_t* c, struct value_t* val) {
+  compile_op(c, OP_CONST, 1);
+  compile_emit(c, compile_constant(c, val));
+}
+
+// Errors that the tree-walking evaluator reported when it reached the
+// form are reported when the code runs as well.
+void compile_error(struct compiler_t* c, const char* message) {
+  compile_op(c, OP_ERROR, 1);
+  compile_emit(c, compile_constant(c, makestring(message)));
+}
+
+void compile_variable(struct compiler_t* c, struct value_t* symbol) {
+  if (symbol == nil_p) {
+    compile_const(c, nil_p);
+    return;
+  }
+
+  struct compile_ref_t ref = compile_resolve(c, symbol);
+
+  switch (ref.kind) {
+  case REF_LOCAL:
+    compile_op(c, OP_LOCAL, 1);
+    compile_emit(c, ref.slot);
+    compile_emit(c, compile_constant(c, symbol));
+    break;
+  case REF_FRAME:
+    compile_op(c, OP_FRAME, 1);
+    compile_emit(c, ref.depth);
+    compile_emit(c, ref.slot);
+    compile_emit(c, compile_constant(c, symbol));
+    break;
+  case REF_GLOBAL:
+    // A global cell stays the same once it exists.
+    if (symbol->symbol.global != 0) {
+      compile_op(c, OP_GLOBAL_CELL, 1);
+      compile_emit(c, compile_constant(c, symbol->symbol.global));
+    }
+    else {
+      compile_op(c, OP_GLOBAL, 1);
+      compile_emit(c, compile_constant(c, symbol));
+    }
+    break;
+  }
+}
+
+// Stores the value on top of the stack, leaving it there.
+void compile_store(struct compiler_t* c, struct compile_ref_t ref,
+                   struct value_t* symbol) {
+  switch (ref.kind) {
+  case REF_LOCAL:
+    compile_op(c, OP_SET_LOCAL, 0);
+    compile_emit(c, ref.slot);
+    break;
+  case REF_FRAME:
+    compile_op(c, OP_SET_FRAME, 0);
+    compile_emit(c, ref.depth);
+    compile_emit(c, ref.slot);
+    break;
+  case REF_GLOBAL:
+    compile_op(c, OP_SET_GLOBAL, 0);
+    compile_emit(c, compile_constant(c, symbol));
+    break;
+  }
+}
+
+void compile_body(struct compiler_t* c, struct value_t* body, int tail) {
+  if (body == nil_p) {
+    compile_const(c, nil_p);
+    return;
+  }
+
+  for (; body != nil_p; body = cdr(body)) {
+    int last = cdr(body) == nil_p;
+
+    compile_form(c, car(body), tail && last);
+    if (!last)
+      compile_op(c, OP_POP, -1);
+  }
+}
+
+void compile_if(struct compiler_t* c, struct value_t* form, int tail) {
+  struct value_t* alternative = cdr(cdr(cdr(form)));
+  size_t else_jump;
+  size_t end_jump = 0;
+
+  compile_form(c, car(cdr(form)), 0);
+  compile_op(c, OP_JUMP_IF_NIL, -1);
+  else_jump = c->size;
+  compile_emit(c, 0);
+
+  size_t depth = c->depth;
+
+  compile_form(c, car(cdr(cdr(form))), tail);
+
+  if (tail)
+    compile_op(c, OP_RETURN, -1);
+  else {
+    compile_op(c, OP_JUMP, 0);
+    end_jump = c->size;
+    compile_emit(c, 0);
+  }
+
+  c->ops[else_jump] = c->size;
+  c->depth = depth;
+
+  if (alternative != nil_p)
+    compile_form(c, car(alternative), tail);
+  else
+    compile_const(c, nil_p);
+
+  if (!tail)
+    c->ops[end_jump] = c->size;
+}
+
+// An inline lambda evaluates its arguments, stores them into fresh
+// slots and goes on with its body.
+void compile_inline(struct compiler_t* c, struct value_t* form, int tail) {
+  struct value_t* lambda = car(form);
+  struct compile_scope_t scope = {c->scope, 0, 0, 0};
+  struct value_t* args;
+  struct value_t* params;
+  size_t first;
+  size_t count = 0;
+
+  for (args = cdr(form); args != nil_p; args = cdr(args), count++)
+    compile_form(c, car(args), 0);
+
+  c->scope = &scope;
+  first = c->slots;
+
+  for (params = car(cdr(lambda)); params != nil_p; params = cdr(params))
+    compile_declare(c, car(params));
+
+  for (size_t i = count; i > 0; i--) {
+    compile_store(c, compile_local_ref(c, first + i - 1), 0);
+    compile_op(c, OP_POP, -1);
+  }
+
+  for (struct value_t* body = cdr(cdr(lambda)); body != nil_p; body = cdr(body))
+    compile_scan(c, car(body));
+
+  compile_body(c, cdr(cdr(lambda)), tail);
+
+  c->scope = scope.parent;
+  free(scope.bindings);
+}
+
+// The bindings visible at this point, innermost first, as
+// ((symbol . slot)...).
+struct value_t* compile_scope_alist(struct compiler_t* c) {
+  struct value_t* res = nil_p;
+  struct value_t* tail = nil_p;
+
+  for (struct compile_scope_t* scope = c->scope; scope != 0;
+       scope = scope->parent) {
+    for (size_t i = scope->size; i > 0; i--) {
+      struct compile_binding_t* binding = &scope->bindings[i - 1];
+      struct value_t* cell = cons(cons(binding->symbol,
+                                       MAKE_FIXNUM(binding->slot)), nil_p);
+
+      if (res == nil_p)
+        res = cell;
       else
-        return token_buf_to_str();
+        tail->cons.cdr = cell;
+
+      tail = cell;
+    }
+  }
+
+  return res;
+}
+
+void compile_closure(struct compiler_t* c, struct value_t* form) {
+  c->closures = 1;
+
+  // compile_code() starts over with a heap frame.
+  if (!c->heap) {
+    compile_const(c, nil_p);
+    return;
+  }
+
+  struct value_t* code = makecode(cdr(form),
+                                  cons(compile_scope_alist(c), c->outer));
+
+  compile_op(c, OP_CLOSURE, 1);
+  compile_emit(c, compile_constant(c, code));
+}
+
+// The fixnum opcode for a call of a global that holds one of the
+// compile_fixnum_ops primitives with two arguments, or OP_CALL.
+enum opcode_t compile_fixnum_op(struct compiler_t* c, struct value_t* form) {
+  struct value_t* head = car(form);
+  struct value_t* args = cdr(form);
+
+  if (type_of(head) != SYMBOL || head->symbol.global == 0
+      || type_of(args) != CONS || type_of(cdr(args)) != CONS
+      || cdr(cdr(args)) != nil_p
+      || compile_resolve(c, head).kind != REF_GLOBAL)
+    return OP_CALL;
+
+  struct value_t* val = cdr(head->symbol.global);
+
+  if (type_of(val) == PRIMITIVE) {
+    for (size_t i = 0; i < sizeof(compile_fixnum_ops) / sizeof(compile_fixnum_ops[0]); i++) {
+      if (compile_fixnum_ops[i].op2 == val->primitive->op2)
+        return compile_fixnum_ops[i].op;
+    }
+  }
+
+  return OP_CALL;
+}
+
+void compile_call(struct compiler_t* c, struct value_t* form, int tail) {
+  struct value_t* head = car(form);
+  struct value_t* args;
+  enum opcode_t op = compile_fixnum_op(c, form);
+  int argc = 0;
+
+  if (op == OP_CALL)
+    compile_form(c, head, 0);
+
+  for (args = cdr(form); args != nil_p; args = cdr(args), argc++)
+    compile_form(c, car(args), 0);
+
+  if (op != OP_CALL) {
+    // Room for the callee, in case it has to be called after all.
+    if (c->depth + 1 > c->max_depth)
+      c->max_depth = c->depth + 1;
+
+    compile_op(c, op, -1);
+    compile_emit(c, compile_constant(c, head->symbol.global));
+    compile_emit(c, compile_constant(c, head));
+    return;
+  }
+
+  compile_op(c, tail ? OP_TAIL_CALL : OP_CALL, -argc);
+  compile_emit(c, argc);
+  compile_emit(c, type_of(head) == SYMBOL
+                  ? (intptr_t)compile_constant(c, head) : -1);
+}
+
+void compile_form(struct compiler_t* c, struct value_t* form, int tail) {
+  if (type_of(form) == SYMBOL) {
+    compile_variable(c, form);
+    return;
+  }
+
+  if (type_of(form) != CONS) {
+    compile_const(c, form);
+    return;
+  }
+
+  struct value_t* head = car(form);
+  enum special_form_t special = NOT_SPECIAL;
+  struct value_t* macro;
+
+  if (type_of(head) == SYMBOL)
+    special = head->symbol.special_form;
+
+  switch (special) {
+  case SPECIAL_QUOTE:
+    compile_const(c, car(cdr(form)));
+    return;
+
+  case SPECIAL_IF:
+    compile_if(c, form, tail);
+    return;
+
+  // setf stores its second argument as it is, without evaluating it.
+  case SPECIAL_SETF: {
+    struct value_t* sym = car(cdr(form));
+
+    if (sym == nil_p || type_of(sym) != SYMBOL) {
+      compile_error(c, "setf expects a symbol");
+      return;
+    }
+
+    compile_const(c, car(cdr(cdr(form))));
+    compile_store(c, compile_resolve(c, sym), sym);
+    return;
+  }
+
+  case SPECIAL_DEFINE: {
+    struct value_t* sym = car(cdr(form));
+
+    compile_form(c, car(cdr(cdr(form))), 0);
+
+    if (sym == nil_p || type_of(sym) != SYMBOL) {
+      compile_op(c, OP_POP, -1);
+      compile_error(c, "define expects a symbol");
+      return;
+    }
+
+    compile_store(c, compile_local_ref(c, compile_define_slot(c, sym)), sym);
+    return;
+  }
+
+  // Macros are always global, so defmacro is left to eval().
+  case SPECIAL_DEFMACRO:
+    compile_op(c, OP_EVAL, 1);
+    compile_emit(c, compile_constant(c, form));
+    return;
+
+  case SPECIAL_PROGN:
+    compile_body(c, cdr(form), tail);
+    return;
+
+  case SPECIAL_LAMBDA:
+    compile_closure(c, form);
+    return;
+
+  case SPECIAL_MACROEXPAND: {
+    struct value_t* call = car(cdr(form));
+
+    compile_form(c, car(call), 0);
+    compile_const(c, cdr(call));
+    compile_op(c, OP_APPLY, -1);
+    return;
+  }
+
+  case NOT_SPECIAL:
+    break;
+  }
+
+  if ((macro = compile_macro(c, head)) != 0)
+    compile_form(c, macroexpand_form(form, macro), tail);
+  else if (compile_is_inline(form))
+    compile_inline(c, form, tail);
+  else
+    compile_call(c, form, tail);
+}
+
+// Compiles the body of a CODE cell, which has to be rooted. A body that
+// creates closures is compiled a second time, for a heap frame.
+void compile_code(struct value_t* code) {
+  struct value_t* params = car(code->code.lambda);
+  struct value_t* body = cdr(code->code.lambda);
+  int rest = params != nil_p && type_of(params) == SYMBOL;
+  struct compile_scope_t scope = {0};
+  size_t param_count = 0;
+  size_t epoch = macro_epoch;
+  struct compiler_t c = {.outer = code->code.scope,
+                         .scope = &scope,
+                         .constants = arg_stack.size};
+
+  for (;;) {
+    if (rest)
+      compile_declare(&c, params);
+    else {
+      for (struct value_t* p = params; p != nil_p; p = cdr(p)) {
+        if (type_of(p) != CONS || type_of(car(p)) != SYMBOL)
+          die("Can't extend environment");
+
+        compile_declare(&c, car(p));
+      }
+    }
+
+    param_count = c.slots;
+
+    for (struct value_t* b = body; b != nil_p; b = cdr(b))
+      compile_scan(&c, car(b));
+
+    compile_body(&c, body, 1);
+    compile_op(&c, OP_RETURN, -1);
+
+    if (!c.closures || c.heap)
+      break;
+
+    arg_stack.size = c.constants;
+    scope.size = 0;
+    c = (struct compiler_t){.outer = c.outer,
+                            .scope = &scope,
+                            .ops = c.ops,
+                            .capacity = c.capacity,
+                            .constants = c.constants,
+                            .heap = 1};
+  }
+
+  size_t constant_count = arg_stack.size - c.constants;
+  struct bytecode_t* bytecode = malloc(sizeof(struct bytecode_t)
+                                       + c.size * sizeof(intptr_t)
+                                       + constant_count * sizeof(struct value_t*));
+
+  if (bytecode == 0)
+    die("Out of memory");
+
+  *bytecode = (struct bytecode_t){.params = param_count,
+                                  .rest = rest,
+                                  .heap = c.heap,
+                                  .slots = c.slots,
+                                  .stack = c.max_depth,
+                                  .constant_count = constant_count,
+                                  .epoch = epoch};
+  memcpy(bytecode->ops, c.ops, c.size * sizeof(intptr_t));
+  bytecode->constants = (struct value_t**)(bytecode->ops + c.size);
+  memcpy(bytecode->constants, arg_stack.data + c.constants,
+         constant_count * sizeof(struct value_t*));
+
+  arg_stack.size = c.constants;
+  free(c.ops);
+  free(scope.bindings);
+
+  if (code->code.bytecode != 0) {
+    struct value_t* old = makecode(code->code.lambda, code->code.scope);
+
+    old->code.bytecode = code->code.bytecode;
+    retired_code = cons(old, retired_code);
+  }
+
+  code->code.bytecode = bytecode;
+  gc_write_barrier(code);
+}
+
+// Call records of the procedures that vm_call() returns to.
+struct vm_frame_t {
+  struct bytecode_t* code;
+  intptr_t* pc;
+  size_t fp;
+  struct value_t* env;
+  size_t profile;
+};
+
+struct vm_frames_t {
+  struct vm_frame_t* data;
+  size_t size;
+  size_t capacity;
+};
+
+struct vm_frames_t vm_frames = {0};
+
+void vm_frames_push(struct vm_frame_t frame) {
+  if (vm_frames.size == vm_frames.capacity) {
+    vm_frames.capacity = vm_frames.capacity ? vm_frames.capacity * 2 : 256;
+    vm_frames.data = realloc(vm_frames.data,
+                             vm_frames.capacity * sizeof(struct vm_frame_t));
+    if (vm_frames.data == 0)
+      die("Out of memory");
+  }
+
+  vm_frames.data[vm_frames.size++] = frame;
+}
+
+const char* vm_name(struct value_t** constants, intptr_t name) {
+  return name >= 0 ? constants[name]->symbol.name : "lambda";
+}
+
+void vm_unbound(struct value_t* symbol) {
+  die("Unbound symbol: %s\n", symbol->symbol.name);
+}
+
+void vm_not_callable(struct value_t* callee, const char* name) {
+  // The call was compiled before the macro existed, and the macro was
+  // defined while that code was still running.
+  if (type_of(callee) == MACRO)
+    die("Macro %s was defined while a procedure using it was running\n",
+        name);
+
+  die("Unsupported procedure type");
+}
+
+struct value_t* vm_frame(struct value_t* env, intptr_t depth) {
+  for (; depth > 0; depth--)
+    env = env->vector.items[0];
+
+  return env;
+}
+
+#ifdef __GNUC__
+#define VM_COMPUTED_GOTO
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define VM_CASE(op) vm_##op:
+#define VM_NEXT() goto *vm_labels[*pc]
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT() goto dispatch
+#endif
+
+// Anything that can push onto arg_stack may move it, so sp and fp are
+// turned into indices around such calls.
+#define VM_SAVE() \
+  (arg_stack.size = sp - arg_stack.data, fp_index = fp - arg_stack.data)
+
+#define VM_LOAD() \
+  (sp = arg_stack.data + arg_stack.size, fp = arg_stack.data + fp_index)
+
+// Profiling samples are folded in at the same safe points, which come
+// around at least once per nursery.
+#define VM_SAFE_POINT() \
+  if (need_gc()) { \
+    VM_SAVE(); \
+    if (profile_pending) \
+      profile_flush(); \
+    collectgarbage(); \
+  }
+
+// The fixnum opcodes take their arguments from the stack and the
+// primitive from its global cell. When they can't do the arithmetic
+// themselves, they put the callee below the arguments and carry on as
+// OP_CALL, whose name operand they share. Fixnums are 63 bits, so a sum
+// or difference of two can't overflow a long, and neither can a product
+// of two that fit in 31 bits; other products are left to the primitive,
+// guard being false.
+#define VM_HALF_FIXNUM(x) ((x) > -2147483648L && (x) < 2147483648L)
+
+#define VM_FIXNUM_CASE(opcode, op2_fn, guard, result) \
+  VM_CASE(opcode) { \
+    callee = constants[pc[1]]->cons.cdr; \
+\
+    if (IS_FIXNUM(sp[-2]) && IS_FIXNUM(sp[-1]) && !profiling \
+        && type_of(callee) == PRIMITIVE && callee->primitive->op2 == op2_fn) { \
+      long a = FIXNUM_VALUE(sp[-2]); \
+      long b = FIXNUM_VALUE(sp[-1]); \
+\
+      if (guard) { \
+        sp--; \
+        sp[-1] = (result); \
+        pc += 3; \
+        VM_NEXT(); \
+      } \
+    } \
+\
+    sp[0] = sp[-1]; \
+    sp[-1] = sp[-2]; \
+    sp[-2] = callee; \
+    sp++; \
+    n = 2; \
+    goto call; \
+  }
+
+// Calls the procedure below the top argc entries of arg_stack with
+// those as its arguments, and pops all of them. Calls between compiled
+// procedures stay inside this loop: frames are pushed onto arg_stack
+// with the callee below them at fp[-1], the slots from fp[0] and the
+// temporaries above, and a tail call moves its callee and arguments
+// down over the frame of its caller.
+struct value_t* vm_call(size_t argc, const char* name) {
+#ifdef VM_COMPUTED_GOTO
+  static void* vm_labels[] = {
+    &&vm_OP_CONST, &&vm_OP_LOCAL, &&vm_OP_SET_LOCAL, &&vm_OP_FRAME,
+    &&vm_OP_SET_FRAME, &&vm_OP_GLOBAL, &&vm_OP_GLOBAL_CELL,
+    &&vm_OP_SET_GLOBAL, &&vm_OP_POP, &&vm_OP_JUMP, &&vm_OP_JUMP_IF_NIL,
+    &&vm_OP_CLOSURE, &&vm_OP_CALL, &&vm_OP_TAIL_CALL, &&vm_OP_ADD,
+    &&vm_OP_SUB, &&vm_OP_MUL, &&vm_OP_LESS, &&vm_OP_GREATER,
+    &&vm_OP_EQUALS, &&vm_OP_RETURN, &&vm_OP_APPLY, &&vm_OP_EVAL,
+    &&vm_OP_ERROR
+  };
+#endif
+  size_t base = vm_frames.size;
+  size_t profile_frame = profile_stack.size;
+  size_t fp_index;
+  size_t n = argc;
+  struct value_t** sp = arg_stack.data + arg_stack.size;
+  struct value_t** fp = sp;
+  struct value_t* callee = *(sp - n - 1);
+  struct value_t* env = 0;
+  struct value_t* res;
+  struct value_t** constants = 0;
+  struct bytecode_t* code = 0;
+  intptr_t* pc = 0;
+
+  if (type_of(callee) == PRIMITIVE) {
+    res = call_primitive(callee->primitive, n, sp - n);
+    arg_stack.size -= n + 1;
+    return res;
+  }
+
+  if (type_of(callee) != PROC && type_of(callee) != MACRO)
+    die("Unsupported procedure type");
+
+  if (profiling)
+    profile_push(name);
+
+enter: {
+    struct value_t* body = callee->proc.body;
+
+    VM_SAFE_POINT();
+
+    if (body->code.bytecode == 0
+        || body->code.bytecode->epoch != macro_epoch) {
+      VM_SAVE();
+      compile_code(body);
+      VM_LOAD();
+    }
+
+    code = body->code.bytecode;
+
+    size_t need = code->slots + code->stack + 1;
+
+    if (arg_stack.capacity - (size_t)(sp - arg_stack.data) < need) {
+      VM_SAVE();
+      value_stack_reserve(&arg_stack, need);
+      VM_LOAD();
+    }
+
+    fp = sp - n;
+
+    if (code->rest) {
+      struct value_t* list = nil_p;
+
+      while (sp > fp)
+        list = cons(*--sp, list);
+      *sp++ = list;
+    }
+    else if (n > code->params)
+      sp = fp + code->params;
+
+    // Missing arguments read as nil, variables that haven't been
+    // defined yet are unbound.
+    while (sp < fp + code->params)
+      *sp++ = nil_p;
+    while (sp < fp + code->slots)
+      *sp++ = 0;
+
+    if (code->heap) {
+      struct value_t* frame = makevector(code->slots + 1, 0);
+
+      frame->vector.items[0] = callee->proc.env;
+      memcpy(frame->vector.items + 1, fp,
+             code->slots * sizeof(struct value_t*));
+      fp[0] = frame;
+      sp = fp + 1;
+      env = frame;
+    }
+    else
+      env = callee->proc.env;
+
+    constants = code->constants;
+    pc = code->ops;
+    VM_NEXT();
+  }
+
+#ifndef VM_COMPUTED_GOTO
+dispatch:
+  switch (*pc) {
+#endif
+
+  VM_CASE(OP_CONST)
+    *sp++ = constants[pc[1]];
+    pc += 2;
+    VM_NEXT();
+
+  VM_CASE(OP_LOCAL)
+    if ((*sp++ = fp[pc[1]]) == 0)
+      vm_unbound(constants[pc[2]]);
+    pc += 3;
+    VM_NEXT();
+
+  VM_CASE(OP_SET_LOCAL)
+    fp[pc[1]] = sp[-1];
+    pc += 2;
+    VM_NEXT();
+
+  VM_CASE(OP_FRAME) {
+    struct value_t* frame = vm_frame(env, pc[1]);
+
+    if ((*sp++ = frame->vector.items[pc[2] + 1]) == 0)
+      vm_unbound(constants[pc[3]]);
+    pc += 4;
+    VM_NEXT();
+  }
+
+  VM_CASE(OP_SET_FRAME) {
+    struct value_t* frame = vm_frame(env, pc[1]);
+
+    frame->vector.items[pc[2] + 1] = sp[-1];
+    gc_write_barrier_ref(frame, sp[-1]);
+    pc += 3;
+    VM_NEXT();
+  }
+
+  VM_CASE(OP_GLOBAL) {
+    struct value_t* cell = constants[pc[1]]->symbol.global;
+
+    if (cell == 0)
+      vm_unbound(constants[pc[1]]);
+    *sp++ = cell->cons.cdr;
+    pc += 2;
+    VM_NEXT();
+  }
+
+  VM_CASE(OP_GLOBAL_CELL)
+    *sp++ = constants[pc[1]]->cons.cdr;
+    pc += 2;
+    VM_NEXT();
+
+  VM_CASE(OP_SET_GLOBAL) {
+    struct value_t* cell = constants[pc[1]]->symbol.global;
+
+    if (cell == 0)
+      vm_unbound(constants[pc[1]]);
+    set_global(cell, sp[-1]);
+    pc += 2;
+    VM_NEXT();
+  }
+
+  VM_CASE(OP_POP)
+    sp--;
+    pc++;
+    VM_NEXT();
+
+  VM_CASE(OP_JUMP)
+    pc = code->ops + pc[1];
+    VM_NEXT();
+
+  VM_CASE(OP_JUMP_IF_NIL)
+    if (*--sp == nil_p)
+      pc = code->ops + pc[1];
+    else
+      pc += 2;
+    VM_NEXT();
+
+  VM_CASE(OP_CLOSURE) {
+    struct value_t* lambda = constants[pc[1]];
+
+    *sp++ = makeproc(car(lambda->code.lambda), lambda, env);
+    pc += 2;
+    VM_NEXT();
+  }
+
+  VM_CASE(OP_CALL)
+    n = pc[1];
+  call:
+    callee = *(sp - n - 1);
+
+    if (type_of(callee) == PRIMITIVE) {
+      res = call_primitive(callee->primitive, n, sp - n);
+      sp -= n;
+      sp[-1] = res;
+      pc += 3;
+      VM_NEXT();
+    }
+
+    if (type_of(callee) != PROC)
+      vm_not_callable(callee, vm_name(constants, pc[2]));
+
+    vm_frames_push((struct vm_frame_t){code, pc + 3, fp - arg_stack.data,
+                                       env, profile_frame});
+    profile_frame = profile_stack.size;
+    if (profiling)
+      profile_push(vm_name(constants, pc[2]));
+    goto enter;
+
+  VM_CASE(OP_TAIL_CALL)
+    n = pc[1];
+    callee = *(sp - n - 1);
+
+    if (type_of(callee) == PRIMITIVE) {
+      res = call_primitive(callee->primitive, n, sp - n);
+      sp -= n;
+      sp[-1] = res;
+      goto vm_return;
+    }
+
+    if (type_of(callee) != PROC)
+      vm_not_callable(callee, vm_name(constants, pc[2]));
+
+    // The arguments only ever move down, so a forward copy is safe.
+    {
+      struct value_t** to = fp - 1;
+      struct value_t** from = sp - n - 1;
+
+      for (size_t i = 0; i <= n; i++)
+        to[i] = from[i];
+    }
+    sp = fp + n;
+    if (profiling) {
+      profile_stack.size = profile_frame;
+      profile_push(vm_name(constants, pc[2]));
+    }
+    goto enter;
+
+  VM_FIXNUM_CASE(OP_ADD, primitive_plus2, 1, makeint(a + b))
+  VM_FIXNUM_CASE(OP_SUB, primitive_minus2, 1, makeint(a - b))
+  VM_FIXNUM_CASE(OP_MUL, primitive_mul2, VM_HALF_FIXNUM(a) && VM_HALF_FIXNUM(b),
+                 makeint(a * b))
+  VM_FIXNUM_CASE(OP_LESS, primitive_less2, 1, a < b ? t_p : nil_p)
+  VM_FIXNUM_CASE(OP_GREATER, primitive_greater2, 1, a > b ? t_p : nil_p)
+  VM_FIXNUM_CASE(OP_EQUALS, primitive_equals2, 1, a == b ? t_p : nil_p)
+
+  VM_CASE(OP_RETURN)
+  vm_return: {
+    struct vm_frame_t* frame;
+
+    res = sp[-1];
+    sp = fp - 1;
+    profile_stack.size = profile_frame;
+
+    if (vm_frames.size == base) {
+      arg_stack.size = sp - arg_stack.data;
+      return res;
+    }
+
+    frame = &vm_frames.data[--vm_frames.size];
+    code = frame->code;
+    pc = frame->pc;
+    fp = arg_stack.data + frame->fp;
+    env = frame->env;
+    profile_frame = frame->profile;
+    constants = code->constants;
+    *sp++ = res;
+    VM_NEXT();
+  }
+
+  VM_CASE(OP_APPLY) {
+    struct value_t* args = *--sp;
+
+    VM_SAVE();
+    res = apply_list(sp[-1], args, "macroexpand");
+    VM_LOAD();
+    sp[-1] = res;
+    pc++;
+    VM_NEXT();
+  }
+
+  VM_CASE(OP_EVAL)
+    VM_SAVE();
+    res = eval(constants[pc[1]]);
+    VM_LOAD();
+    *sp++ = res;
+    pc += 2;
+    VM_NEXT();
+
+  VM_CASE(OP_ERROR) {
+    struct value_t* message = constants[pc[1]];
+
+    die("%.*s", (int)message->string.length, message->string.data);
+  }
+
+#ifndef VM_COMPUTED_GOTO
+  }
+#endif
+
+  return 0;
+}
+
+// Evaluates every form of body except the last one, and returns the
+// last one so that the caller can evaluate it in tail position.
+struct value_t* eval_body_init(struct value_t* body) {
+  GC_ROOT_SCOPE_BEGIN;
+  GC_ROOT(body);
+
+  for (; cdr(body) != nil_p; body = cdr(body))
+    eval(car(body));
+
+  GC_ROOT_SCOPE_END;
+
+  return car(body);
+}
+
+// Arguments are evaluated onto arg_stack above the procedure, which is
+// where vm_call() takes them from. Nested calls stack their arguments
+// on top.
+struct value_t* eval_call(struct value_t* proc, struct value_t* args,
+                          const char* name) {
+  size_t base = arg_stack.size;
+
+  value_stack_push(&arg_stack, proc);
+  for (; args != nil_p; args = cdr(args))
+    value_stack_push(&arg_stack, eval(car(args)));
+
+  return vm_call(arg_stack.size - base - 1, name);
+}
+
+// eval() only runs toplevel forms; procedure bodies run on the VM.
+// Special forms are recognized by a tag stored in their symbol, so
+// that ordinary applications don't have to be compared against each
+// special form symbol in turn.
+//
+// *valp is the rooted loop variable of eval(). Forms in tail position
+// aren't evaluated here: they are stored back into *valp and 0 is
+// returned, so that eval() continues with them without growing the C
+// stack.
+struct value_t* eval_cons(struct value_t** valp) {
+  struct value_t* val = *valp;
+  struct value_t* head = car(val);
+  enum special_form_t form = NOT_SPECIAL;
+
+  if (type_of(head) == SYMBOL)
+    form = head->symbol.special_form;
+
+  switch (form) {
+  case SPECIAL_IF: {
+    struct value_t* condition = cdr(val);
+    struct value_t* action = cdr(cdr(val));
+    struct value_t* alternative = cdr(cdr(cdr(val)));
+
+    if (eval(car(condition)) != nil_p)
+      *valp = car(action);
+    else if (alternative != nil_p)
+      *valp = car(alternative);
+    else
+      return nil_p;
+
+    return 0;
+  }
+
+  case SPECIAL_QUOTE:
+    return car(cdr(val));
+
+  case SPECIAL_SETF: {
+    struct value_t* sym = car(cdr(val));
+    struct value_t* symval = car(cdr(cdr(val)));
+
+    if (sym == nil_p || type_of(sym) != SYMBOL)
+      die("setf expects a symbol");
+
+    struct value_t* tmp = sym->symbol.global;
+    if (tmp == 0)
+      die("Unbound symbol: %s\n", sym->symbol.name);
+
+    set_global(tmp, symval);
+
+    return symval;
+  }
+
+  case SPECIAL_DEFINE: {
+    struct value_t* sym = car(cdr(val));
+    struct value_t* symval = eval(car(cdr(cdr(val))));
+
+    if (sym == nil_p || type_of(sym) != SYMBOL)
+      die("define expects a symbol");
+
+    define_global(sym, symval);
+
+    return symval;
+  }
+
+  case SPECIAL_DEFMACRO: {
+    struct value_t* sym = car(cdr(val));
+    struct value_t* params = car(cdr(cdr(val)));
+    struct value_t* code = makecode(cdr(cdr(val)), nil_p);
+
+    struct value_t* macro = makemacro(params, code, toplevel_env);
+
+    if (sym == nil_p || type_of(sym) != SYMBOL)
+      die("define expects a symbol");
+
+    define_global(sym, macro);
+
+    return macro;
+  }
+
+  case SPECIAL_PROGN:
+    *valp = eval_body_init(cdr(val));
+    return 0;
+
+  case SPECIAL_LAMBDA: {
+    struct value_t* code = makecode(cdr(val), nil_p);
+
+    return makeproc(car(cdr(val)), code, toplevel_env);
+  }
+
+  case SPECIAL_MACROEXPAND: {
+    struct value_t* proc = eval(car(car(cdr(val))));
+
+    return apply_list(proc, cdr(car(cdr(val))), "macroexpand");
+  }
+
+  case NOT_SPECIAL:
+    break;
+  }
+
+  struct value_t* proc = eval(head);
+
+  if (type_of(proc) == PRIMITIVE || type_of(proc) == PROC)
+    return eval_call(proc, cdr(val), profile_name(head, "lambda"));
+
+  if (type_of(proc) == MACRO) {
+    *valp = macroexpand_form(val, proc);
+    return 0;
+  }
+
+  die("Unsupported procedure type");
+  return nil_p;
+}
+
+struct value_t* eval(struct value_t* val) {
+  struct value_t* res = 0;
+
+  GC_ROOT_SCOPE_BEGIN;
+  GC_ROOT(val);
+
+  do {
+    // Profiling samples are folded in at the same safe points, which
+    // come around at least once per nursery.
+    if (need_gc()) {
+      if (profile_pending)
+        profile_flush();
+      collectgarbage();
     }
 
-    if (*p == '(' ||
-        *p == ')' ||
-        *p == ';' ||
-        *p == '\'' ||
-        isspace(*p)) {
-      *strp = p;
-      return token_buf_to_str();
-    }
+    if (val == nil_p) {
+      res = nil_p;
+      break;
+    }
+
+    switch(type_of(val)) {
+    case INT:
+    case STRING:
+    case PRIMITIVE:
+    case PROC:
+    case MACRO:
+    case VECTOR:
+    case HASH_TABLE:
+    case CODE:
+      res = val;
+      break;
+    case SYMBOL:
+      if (val->symbol.global == 0)
+        die("Unbound symbol: %s\n", val->symbol.name);
+      res = cdr(val->symbol.global);
+      break;
+    case CONS:
+      res = eval_cons(&val);
+      break;
+    case GUARD:
+      die("Access to deallocated memory");
+      break;
+    };
+  } while (res == 0);
+
+  GC_ROOT_SCOPE_END;
+
+  return res;
+}
+
+// Missing arguments read as nil.
+#define ARG(i) \
+  ((size_t)(i) < argc ? argv[i] : nil_p)
+
+struct value_t* primitive_cons(size_t argc, struct value_t** argv) {
+  return cons(ARG(0), ARG(1));
+}
+
+struct value_t* primitive_car(size_t argc, struct value_t** argv) {
+  return car(ARG(0));
+}
+
+struct value_t* primitive_cdr(size_t argc, struct value_t** argv) {
+  return cdr(ARG(0));
+}
+
+struct value_t* primitive_plus(size_t argc, struct value_t** argv) {
+  long sum = 0;
+
+  for (size_t i = 0; i < argc; i++) {
+    if (type_of(argv[i]) != INT)
+      die("Can't add non-integer values");
+
+    sum = sum + get_int(argv[i]);
+  }
+
+  return makeint(sum);
+}
+
+struct value_t* primitive_minus(size_t argc, struct value_t** argv) {
+  long sum = 0;
+
+  for (size_t i = 0; i < argc; i++) {
+    if (type_of(argv[i]) != INT)
+      die("Can't add non-integer values");
+
+    if (i == 0)
+      sum = sum + get_int(argv[i]);
+    else
+      sum = sum - get_int(argv[i]);
+  }
+
+  if (argc == 1)
+    return makeint(-sum);
+
+  return makeint(sum);
+}
+
+struct value_t* primitive_mul(size_t argc, struct value_t** argv) {
+  long mul = 1;
+
+  for (size_t i = 0; i < argc; i++) {
+    if (type_of(argv[i]) != INT)
+      die("Can't multiply non-integer values");
+
+    mul = mul * get_int(argv[i]);
+  }
+
+  return makeint(mul);
+}
+
+struct value_t* primitive_div(size_t argc, struct value_t** argv) {
+  if (argc == 0)
+    die("Need at least 1 integer to compare");
+  if (type_of(argv[0]) != INT)
+    die("Can't add non-integer values");
+
+  long res = get_int(argv[0]);
+
+  for (size_t i = 1; i < argc; i++) {
+    if (type_of(argv[i]) != INT)
+      die("Can't divide non-integer values");
+
+    res = res / get_int(argv[i]);
+  }
+
+  return makeint(res);
+}
+
+
+struct value_t* primitive_equals(size_t argc, struct value_t** argv) {
+  if (argc == 0)
+    die("Need at least 1 integer to compare");
+  if (type_of(argv[0]) != INT)
+    die("Can't add non-integer values");
+
+  long res = get_int(argv[0]);
+
+  for (size_t i = 0; i < argc; i++) {
+    if (type_of(argv[i]) != INT)
+      die("Can't compare non-integer values");
+
+    if (res != get_int(argv[i]))
+      return nil_p;
+  }
+
+  return t_p;
+}
+
+// (< a b c ...) holds when the arguments are strictly increasing, and
+// (> a b c ...) when they are strictly decreasing.
+struct value_t* compare_chain(size_t argc, struct value_t** argv,
+                              int increasing) {
+  if (argc == 0)
+    die("Need at least 1 integer to compare");
+  if (type_of(argv[0]) != INT)
+    die("Can't compare non-integer values");
+
+  long prev = get_int(argv[0]);
+
+  for (size_t i = 1; i < argc; i++) {
+    if (type_of(argv[i]) != INT)
+      die("Can't compare non-integer values");
+
+    long next = get_int(argv[i]);
+
+    if (increasing ? prev >= next : prev <= next)
+      return nil_p;
+
+    prev = next;
+  }
+
+  return t_p;
+}
+
+struct value_t* primitive_less(size_t argc, struct value_t** argv) {
+  return compare_chain(argc, argv, 1);
+}
+
+struct value_t* primitive_greater(size_t argc, struct value_t** argv) {
+  return compare_chain(argc, argv, 0);
+}
+
+// Fixed-arity versions of the most common primitives, used when a call
+// has exactly that many arguments so that they skip the argument loop.
+struct value_t* primitive_car1(struct value_t* a) {
+  return car(a);
+}
+
+struct value_t* primitive_cdr1(struct value_t* a) {
+  return cdr(a);
+}
+
+struct value_t* primitive_cons2(struct value_t* a, struct value_t* b) {
+  return cons(a, b);
+}
+
+struct value_t* primitive_plus2(struct value_t* a, struct value_t* b) {
+  if (type_of(a) != INT || type_of(b) != INT)
+    die("Can't add non-integer values");
+
+  return makeint(get_int(a) + get_int(b));
+}
+
+struct value_t* primitive_minus2(struct value_t* a, struct value_t* b) {
+  if (type_of(a) != INT || type_of(b) != INT)
+    die("Can't add non-integer values");
+
+  return makeint(get_int(a) - get_int(b));
+}
+
+struct value_t* primitive_mul2(struct value_t* a, struct value_t* b) {
+  if (type_of(a) != INT || type_of(b) != INT)
+    die("Can't multiply non-integer values");
+
+  return makeint(get_int(a) * get_int(b));
+}
+
+struct value_t* primitive_div2(struct value_t* a, struct value_t* b) {
+  if (type_of(a) != INT)
+    die("Can't add non-integer values");
+  if (type_of(b) != INT)
+    die("Can't divide non-integer values");
+
+  return makeint(get_int(a) / get_int(b));
+}
+
+struct value_t* primitive_equals2(struct value_t* a, struct value_t* b) {
+  if (type_of(a) != INT)
+    die("Can't add non-integer values");
+  if (type_of(b) != INT)
+    die("Can't compare non-integer values");
+
+  return get_int(a) == get_int(b) ? t_p : nil_p;
+}
+
+struct value_t* primitive_less2(struct value_t* a, struct value_t* b) {
+  if (type_of(a) != INT || type_of(b) != INT)
+    die("Can't compare non-integer values");
+
+  return get_int(a) < get_int(b) ? t_p : nil_p;
+}
+
+struct value_t* primitive_greater2(struct value_t* a, struct value_t* b) {
+  if (type_of(a) != INT || type_of(b) != INT)
+    die("Can't compare non-integer values");
+
+  return get_int(a) > get_int(b) ? t_p : nil_p;
+}
+
+struct value_t* check_type(struct value_t* val, enum type_t type,
+                           const char* message) {
+  if (type_of(val) != type)
+    die(message);
+
+  return val;
+}
+
+size_t vector_index(struct value_t* vec, struct value_t* index) {
+  if (type_of(index) != INT)
+    die("Vector index must be an integer");
+
+  long i = get_int(index);
+
+  if (i < 0 || (size_t)i >= vec->vector.size)
+    die("Vector index out of range: %ld", i);
+
+  return i;
+}
+
+struct value_t* primitive_make_vector(size_t argc, struct value_t** argv) {
+  if (type_of(ARG(0)) != INT || get_int(ARG(0)) < 0)
+    die("make-vector expects a non-negative size");
+  if ((unsigned long)get_int(ARG(0)) > VECTOR_MAX_SIZE)
+    die("make-vector: size too large: %ld", get_int(ARG(0)));
+
+  return makevector(get_int(ARG(0)), ARG(1));
+}
+
+struct value_t* primitive_vector_ref(size_t argc, struct value_t** argv) {
+  struct value_t* vec = check_type(ARG(0), VECTOR,
+                                   "vector-ref expects a vector");
+
+  return vec->vector.items[vector_index(vec, ARG(1))];
+}
+
+struct value_t* primitive_vector_set(size_t argc, struct value_t** argv) {
+  struct value_t* vec = check_type(ARG(0), VECTOR,
+                                   "vector-set! expects a vector");
+  struct value_t* item = ARG(2);
+
+  vec->vector.items[vector_index(vec, ARG(1))] = item;
+  gc_write_barrier_ref(vec, item);
+
+  return item;
+}
+
+struct value_t* primitive_vector_length(size_t argc, struct value_t** argv) {
+  struct value_t* vec = check_type(ARG(0), VECTOR,
+                                   "vector-length expects a vector");
+
+  return makeint(vec->vector.size);
+}
+
+struct value_t* primitive_make_hash(size_t argc, struct value_t** argv) {
+  return makehash();
+}
+
+// (hash-get table key [default]) returns default, or nil, when the key
+// isn't there.
+struct value_t* primitive_hash_get(size_t argc, struct value_t** argv) {
+  struct value_t* table = check_type(ARG(0), HASH_TABLE,
+                                     "hash-get expects a hash table");
+  struct value_t* res = hash_table_get(table, ARG(1));
 
-    add_to_token_buf(*p);
-  }
+  return res ? res : ARG(2);
 }
 
+struct value_t* primitive_hash_put(size_t argc, struct value_t** argv) {
+  struct value_t* table = check_type(ARG(0), HASH_TABLE,
+                                     "hash-put expects a hash table");
+  struct value_t* value = ARG(2);
 
-int is_number(const char* str) {
-  char* endptr;
-  strtol(str, &endptr, 10);
+  hash_table_put(table, ARG(1), value);
 
-  if (*endptr == '\0')
-    return 1;
+  return value;
+}
 
-  return 0;
+struct value_t* primitive_hash_count(size_t argc, struct value_t** argv) {
+  struct value_t* table = check_type(ARG(0), HASH_TABLE,
+                                     "hash-count expects a hash table");
+
+  return makeint(table->hash.size);
 }
 
-struct value_t* readobj(const char** strp);
+struct value_t* primitive_string_length(size_t argc, struct value_t** argv) {
+  struct value_t* str = check_type(ARG(0), STRING,
+                                   "string-length expects a string");
 
-struct value_t* readlist(const char** strp) {
-  const char* saved = *strp;
-  const char* token = gettoken(strp);
+  return makeint(str->string.length);
+}
 
-  if (token == 0)
-    die("Malformed list");
+size_t string_index(struct value_t* str, struct value_t* index) {
+  if (type_of(index) != INT)
+    die("String index must be an integer");
 
-  if (strcmp(token, ")") == 0) {
-    return nil_p;
-  }
+  long i = get_int(index);
+
+  if (i < 0 || (size_t)i > str->string.length)
+    die("String index out of range: %ld", i);
+
+  return i;
+}
 
-  *strp = saved;
+// (substring str start [end]) shares the characters of str.
+struct value_t* primitive_substring(size_t argc, struct value_t** argv) {
+  struct value_t* str = check_type(ARG(0), STRING,
+                                   "substring expects a string");
+  size_t start = string_index(str, ARG(1));
+  size_t end = argc < 3 ? str->string.length : string_index(str, argv[2]);
 
-  struct value_t* head = readobj(strp);
-  struct value_t* tail = readlist(strp);
+  if (start > end)
+    die("substring: start is past the end");
 
-  return cons(head, tail);
+  return makestring_block(str->string.block, str->string.data + start,
+                          end - start);
 }
 
+struct value_t* primitive_string_append(size_t argc,
+                                        struct value_t** argv) {
+  size_t length = 0;
 
-struct value_t* readobj(const char** strp) {
-  char* token = gettoken(strp);
+  for (size_t i = 0; i < argc; i++)
+    length += check_type(argv[i], STRING,
+                         "string-append expects strings")->string.length;
 
-  if (token == 0)
-    return nil_p;
+  struct string_block_t* block = string_block_alloc(length);
+  char* pos = block->data;
 
-  if (token[0] == '"') {
-    token[strlen(token)-1] = 0;
-    return makestring(token+1);
+  for (size_t i = 0; i < argc; i++) {
+    memcpy(pos, argv[i]->string.data, argv[i]->string.length);
+    pos += argv[i]->string.length;
   }
 
-  if (strcmp(token, "(") == 0) {
-    return readlist(strp);
+  return makestring_block(block, block->data, length);
+}
+
+struct value_t* primitive_gc_tune(size_t argc, struct value_t** argv) {
+  if (argc > 0) {
+    if (get_int(argv[0]) <= 0)
+      die("gc-tune: growth must be positive");
+    gc_growth = get_int(argv[0]);
   }
 
-  if (strcmp(token, "\'") == 0) {
-    return cons(quote_p, cons(readobj(strp), nil_p));
+  if (argc > 1) {
+    if (get_int(argv[1]) < 0)
+      die("gc-tune: minimal threshold can't be negative");
+    gc_min_threshold = get_int(argv[1]);
   }
 
-  if (is_number(token)) {
-    return makeint(strtol(token, NULL, 10));
+  if (argc > 2) {
+    if (get_int(argv[2]) < 0)
+      die("gc-tune: nursery size can't be negative");
+    gc_nursery_size = get_int(argv[2]);
   }
 
-  return intern(token);
+  gc_update_threshold();
+
+  return cons(makeint(gc_growth),
+              cons(makeint(gc_min_threshold),
+                   cons(makeint(gc_nursery_size), nil_p)));
 }
 
-struct value_t* read(const char* str) {
-  const char* strp = str;
 
-  return readobj(&strp);
-}
+const char* type_names[TYPE_COUNT] = {
+  "guard", "symbol", "cons", "int", "proc", "primitive", "macro", "string",
+  "vector", "hash-table", "code"
+};
+
+struct stat_def_t {
+  const char* name;
+  struct value_t* value;
+};
 
-struct value_t* readobj_multiple(const char** strp) {
-  struct value_t* res = readobj(strp);
+struct value_t* make_alist(struct stat_def_t* defs, size_t count) {
+  struct value_t* res = nil_p;
 
-  if (res == nil_p)
-    return nil_p;
+  for (size_t i = count; i > 0; i--)
+    res = cons(cons(intern(defs[i-1].name), defs[i-1].value), res);
 
-  return cons(res, readobj_multiple(strp));
+  return res;
 }
 
-struct value_t* read_multiple(const char* str) {
-  const char* strp = str;
+// Sizes are in cells or bytes and times in microseconds, so that
+// everything is an integer. The counters are read before the result
+// is allocated, so that they don't include it.
+struct value_t* runtime_stats() {
+  size_t allocations = number_of_allocations;
+  size_t in_use = cells_in_use;
+  struct rusage usage;
+  struct stat_def_t by_type[TYPE_COUNT - 1];
+  struct value_t* pauses = nil_p;
+
+  for (size_t i = 1; i < TYPE_COUNT; i++)
+    by_type[i-1] = (struct stat_def_t){type_names[i],
+                                       makeint(allocations_by_type[i])};
+
+  // ru_maxrss is in kilobytes on Linux.
+  getrusage(RUSAGE_SELF, &usage);
+
+  // Keyed by the upper bound of the bucket.
+  for (size_t i = GC_PAUSE_BUCKETS; i > 0; i--) {
+    struct value_t* bound = i == GC_PAUSE_BUCKETS ? intern("inf")
+                                                  : makeint(1L << (i-1));
+
+    pauses = cons(cons(bound, makeint(gc_pause_histogram[i-1])), pauses);
+  }
 
-  struct value_t* res = readobj_multiple(&strp);
-  if (res == nil_p)
-    return nil_p;
+  struct stat_def_t stats[] = {
+    {"allocations", makeint(allocations)},
+    {"allocations-by-type", make_alist(by_type, TYPE_COUNT - 1)},
+    {"cells-in-use", makeint(in_use)},
+    {"slab-bytes", makeint(slab_count * SLAB_BYTES)},
+    {"string-heap-bytes", makeint(string_heap.bytes)},
+    {"live-after-gc", makeint(gc_live_after)},
+    {"collections", makeint(gc_collections)},
+    {"minor-collections", makeint(gc_minor_collections)},
+    {"compactions", makeint(gc_compactions)},
+    {"pause-total-us", makeint(gc_pause_total * 1000)},
+    {"pause-max-us", makeint(gc_pause_max * 1000)},
+    {"mark-time-us", makeint(gc_mark_time * 1000)},
+    {"sweep-time-us", makeint(gc_sweep_time * 1000)},
+    {"full-sweep-bytes", makeint(gc_full_sweep_bytes)},
+    {"full-sweep-us", makeint(gc_full_sweep_time * 1000)},
+    {"pause-histogram-us", pauses},
+    {"max-rss-bytes", makeint(usage.ru_maxrss * 1024L)},
+    {"startup-us", makeint(startup_ms * 1000)},
+    {"elapsed-us", makeint((now_ms() - start_ms) * 1000)},
+  };
 
-  return cons(progn_p, res);
+  return make_alist(stats, sizeof(stats) / sizeof(stats[0]));
 }
 
-void concat(char** lhs, const char* rhs) {
-  if (*lhs == 0) {
-    *lhs = strdup(rhs);
-  }
-  else {
-    *lhs = realloc(*lhs, strlen(*lhs) + strlen(rhs) + 1);
-    strcat(*lhs, rhs);
-  }
+struct value_t* primitive_runtime_stats(size_t argc, struct value_t** argv) {
+  return runtime_stats();
 }
 
-const char* print(struct value_t* obj) {
-  char* ret = 0;
+#undef ARG
+
+// Heap images refer to primitives by their index in this table. op1
+// and op2, when set, are used for calls with exactly one or two
+// arguments.
+struct primitive_def_t primitives[] = {
+  {.name = "cons", .op = primitive_cons, .op2 = primitive_cons2},
+  {.name = "car", .op = primitive_car, .op1 = primitive_car1},
+  {.name = "cdr", .op = primitive_cdr, .op1 = primitive_cdr1},
+  {.name = "+", .op = primitive_plus, .op2 = primitive_plus2},
+  {.name = "-", .op = primitive_minus, .op2 = primitive_minus2},
+  {.name = "=", .op = primitive_equals, .op2 = primitive_equals2},
+  {.name = "<", .op = primitive_less, .op2 = primitive_less2},
+  {.name = ">", .op = primitive_greater, .op2 = primitive_greater2},
+  {.name = "*", .op = primitive_mul, .op2 = primitive_mul2},
+  {.name = "/", .op = primitive_div, .op2 = primitive_div2},
+  {.name = "gc-tune", .op = primitive_gc_tune},
+  {.name = "make-vector", .op = primitive_make_vector},
+  {.name = "vector-ref", .op = primitive_vector_ref},
+  {.name = "vector-set!", .op = primitive_vector_set},
+  {.name = "vector-length", .op = primitive_vector_length},
+  {.name = "make-hash", .op = primitive_make_hash},
+  {.name = "hash-get", .op = primitive_hash_get},
+  {.name = "hash-put", .op = primitive_hash_put},
+  {.name = "hash-count", .op = primitive_hash_count},
+  {.name = "string-length", .op = primitive_string_length},
+  {.name = "substring", .op = primitive_substring},
+  {.name = "string-append", .op = primitive_string_append},
+  {.name = "runtime-stats", .op = primitive_runtime_stats},
+};
 
-  switch(obj->type){
-  case CONS:
-    concat(&ret, "(");
-    for (;;) {
-      const char* s = print(car(obj));
-      concat(&ret, s);
-      free((void*)s);
-
-      if (cdr(obj) == nil_p) {
-        concat(&ret, ")");
-        break;
-      }
+#define PRIMITIVE_COUNT (sizeof(primitives) / sizeof(primitives[0]))
 
-      obj = cdr(obj);
+// Interns the symbols the evaluator refers to directly and registers
+// the permanent roots. Run after loading a heap image too, where it
+// only looks the symbols up again.
+void init_symbols() {
+  nil_p = intern("nil");
 
-      if (obj->type != CONS) {
-        concat(&ret, " . ");
-        const char* s = print(obj);
-        concat(&ret, s);
-        free((void*)s);
-        concat(&ret, ")");
-        break;
-      }
+  gc_root_push(&nil_p);
+  gc_root_push(&toplevel_env);
+  gc_root_push(&retired_code);
+  retired_code = nil_p;
 
-      concat(&ret, " ");
-    }
-    return ret;
-  case STRING:
-    concat(&ret, "\"");
-    concat(&ret, obj->string_value);
-    concat(&ret, "\"");
-    return ret;
-  case SYMBOL:
-    return strdup(obj->symbol.name);
-  case INT:
-    return ltoa(obj->int_value);
-  case PROC:
-    return strdup("#<PROC>");
-  case PRIMITIVE:
-    return strdup("#<PRIMITIVE>");
-  case MACRO:
-    return strdup("#<MACRO>");
-  case GUARD:
-    die("Access to deallocated memory");
-    return 0;
-  }
+  REGISTER_SYMBOL(t);
+  REGISTER_SPECIAL_FORM(quote, SPECIAL_QUOTE);
+  REGISTER_SPECIAL_FORM(if, SPECIAL_IF);
+  REGISTER_SPECIAL_FORM(lambda, SPECIAL_LAMBDA);
+  REGISTER_SPECIAL_FORM(progn, SPECIAL_PROGN);
+  REGISTER_SPECIAL_FORM(setf, SPECIAL_SETF);
+  REGISTER_SPECIAL_FORM(define, SPECIAL_DEFINE);
+  REGISTER_SPECIAL_FORM(defmacro, SPECIAL_DEFMACRO);
+  REGISTER_SPECIAL_FORM(macroexpand, SPECIAL_MACROEXPAND);
 }
 
-struct value_t* extend(struct value_t* env,
-                       struct value_t* symbol,
-                       struct value_t* value) {
-  env->cons.car = cons(cons(symbol, value), env->cons.car);
-
-  return env;
-}
+void init_env() {
+  init_symbols();
 
-struct value_t* multiple_extend(struct value_t* env,
-                                struct value_t* symbols,
-                                struct value_t* values) {
-  env = makeenv(env);
-  struct value_t* res = env->cons.car;
-  struct value_t* val = values;
+  toplevel_env = cons(nil_p, nil_p);
 
-  if (symbols->type == CONS) {
-    struct value_t* sym = symbols;
-    for (;sym != nil_p && val != nil_p; sym = cdr(sym), val=cdr(val)) {
-      res = cons(cons(car(sym), car(val)), res);
-    }
-  }
-  else if (symbols->type == SYMBOL){
-    res = cons(cons(symbols, values), res);
-  }
-  else {
-    die("Can't extend environment");
-  }
+  define_global(intern("nil"), nil_p);
+  define_global(intern("t"), t_p);
 
-  env->cons.car = res;
-  return env;
+  for (size_t i = 0; i < PRIMITIVE_COUNT; i++)
+    define_global(intern(primitives[i].name),
+                  makeprimitive(&primitives[i]));
 }
 
-struct value_t* find_in_env(struct value_t* symbol,
-                            struct value_t* env) {
-  if (symbol == nil_p || env == nil_p)
-    return nil_p;
 
-  struct value_t* entry;
+char* read_file(const char* filename, size_t* size) {
+  FILE *f = fopen(filename, "rb");
+
+   if (f == NULL) {
+     die("Error opening file '%s': %s\n", filename, strerror( errno ));
+   }
 
-  for (entry = env->cons.car; !is_nil(entry); entry = cdr(entry)) {
-    if (car(car(entry)) == symbol)
-      return car(entry);
+  size_t capacity = 4096;
+  char *string = malloc(capacity);
+  size_t used = 0;
+  size_t n;
+
+  while ((n = fread(string + used, 1, capacity - used, f)) > 0) {
+    used += n;
+    if (used == capacity) {
+      capacity *= 2;
+      string = realloc(string, capacity);
+      if (string == 0)
+        die("Out of memory");
+    }
   }
 
-  return find_in_env(symbol, cdr(env));
+  fclose(f);
+
+  *size = used;
+  return string;
 }
 
-struct value_t* eval(struct value_t* val, struct value_t* env);
+// A source file is mmap()ed when possible. Pages that the reader has
+// fully consumed are unmapped after every top-level form, so peak
+// memory is bounded by the largest form rather than by the file size.
+// Anything that can't be mapped, like a pipe, is read into memory.
+struct source_t {
+  char* data;
+  size_t size;
+  size_t released;
+  int mapped;
+};
 
+void source_open(struct source_t* src, const char* filename) {
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
 
-struct value_t* eval_list(struct value_t* val, struct value_t* env) {
-  if (val == nil_p)
-    return nil_p;
+  if (fd < 0)
+    die("Error opening file '%s': %s\n", filename, strerror(errno));
 
-  struct value_t * head = eval(car(val), env);
-  gc_root_push(head);
+  *src = (struct source_t){0};
 
-  struct value_t* res = cons(head,
-                             eval_list(cdr(val), env));
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-  gc_root_pop();
+    if (data != MAP_FAILED) {
+      src->data = data;
+      src->size = st.st_size;
+      src->mapped = 1;
+      close(fd);
+      return;
+    }
+  }
 
-  return res;
+  close(fd);
+  src->data = read_file(filename, &src->size);
 }
 
-struct value_t* eval_cons(struct value_t* val, struct value_t* env) {
-  if (car(val) == if_p) {
-    struct value_t* condition = cdr(val);
-    struct value_t* action = cdr(cdr(val));
-    struct value_t* alternative = cdr(cdr(cdr(val)));
+void source_release(struct source_t* src, const char* pos) {
+  if (!src->mapped)
+    return;
 
-    if (eval(car(condition), env) != nil_p)
-      return eval(car(action), env);
-    else if (alternative != nil_p)
-      return eval(car(alternative), env);
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t consumed = (pos - src->data) / page * page;
 
-    return nil_p;
+  if (consumed > src->released) {
+    munmap(src->data + src->released, consumed - src->released);
+    src->released = consumed;
   }
+}
 
-  if (car(val) == quote_p) {
-    return car(cdr(val));
-  }
+void source_close(struct source_t* src) {
+  if (!src->mapped)
+    free(src->data);
+  else if (src->size > src->released)
+    munmap(src->data + src->released, src->size - src->released);
+}
 
-  if (car(val) == setf_p) {
-    struct value_t* sym = car(cdr(val));
-    struct value_t* symval = car(cdr(cdr(val)));
+struct value_t* eval_file(const char* filename) {
+  struct source_t src;
+  source_open(&src, filename);
 
-    if (sym == nil_p || sym->type != SYMBOL)
-      die("setf expects a symbol");
+  struct reader_t in = {src.data, src.data + src.size};
+  struct value_t* form = nil_p;
+  struct value_t* res = nil_p;
 
-    struct value_t* tmp = find_in_env(sym, env);
-    if (tmp == nil_p)
-      die("Unbound symbol: %s\n", val->symbol.name);
+  GC_ROOT_SCOPE_BEGIN;
+  GC_ROOT(form);
+  GC_ROOT(res);
 
-    tmp->cons.cdr = symval;
+  while ((form = readobj(&in)) != 0) {
+    source_release(&src, in.pos);
 
-    return symval;
+    gc_toplevel_safepoint();
+    res = eval(form);
   }
 
-  if (car(val) == define_p) {
-    struct value_t* sym = car(cdr(val));
-    struct value_t* symval = eval(car(cdr(cdr(val))), env);
+  form = nil_p;
+  GC_ROOT_SCOPE_END;
 
-    if (sym == nil_p || sym->type != SYMBOL)
-      die("define expects a symbol");
+  source_close(&src);
 
-    extend(env, sym, symval);
+  return res;
+}
 
-    return symval;
-  }
+// Heap images let startup skip reading and evaluating stdlib.lisp.
+// --save-image compacts the heap and writes out every slab. Pointers
+// become cell indices, strings and symbol names go to a data section
+// after the cells, and primitives are stored as indices into
+// primitives[]. --load-image maps the file and relocates the cells into
+// fresh slabs. An image only fits the binary that wrote it.
+#define IMAGE_MAGIC "LISPIMG"
+#define IMAGE_VERSION 6
+
+struct image_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t value_size;
+  uint32_t primitives;
+  uint32_t slabs;
+  uint64_t data_size;
+  uint64_t toplevel_env;
+};
 
-  if (car(val) == defmacro_p) {
-    struct value_t* sym = car(cdr(val));
-    struct value_t* params = car(cdr(cdr(val)));
-    struct value_t* body = cdr(cdr(cdr(val)));
+struct image_slab_t {
+  struct memory_slab_t* slab;
+  size_t ordinal;
+};
 
-    struct value_t* macro = makemacro(params, body, toplevel_env);
+// Slabs sorted by address, so that a pointer can be mapped to its
+// index with a binary search.
+struct image_slab_t* image_slabs = 0;
+size_t image_slab_count = 0;
 
-    if (sym == nil_p || sym->type != SYMBOL)
-      die("define expects a symbol");
+int image_slab_compare(const void* a, const void* b) {
+  uintptr_t x = (uintptr_t)((const struct image_slab_t*)a)->slab;
+  uintptr_t y = (uintptr_t)((const struct image_slab_t*)b)->slab;
 
-    extend(toplevel_env, sym, macro);
+  return (x > y) - (x < y);
+}
 
-    return macro;
-  }
+// Heap pointers are encoded as (index + 1) * 2, which keeps null and
+// fixnums (odd) unchanged.
+struct value_t* image_encode(struct value_t* val) {
+  if (val == 0 || IS_FIXNUM(val))
+    return val;
+
+  size_t lo = 0;
+  size_t hi = image_slab_count;
+
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    struct memory_slab_t* slab = image_slabs[mid].slab;
 
-  if (car(val) == progn_p) {
-    struct value_t* tmp = cdr(val);
-    for (;;) {
-      struct value_t* res = eval(car(tmp), env);
-      if (cdr(tmp) == nil_p)
-        return res;
-      tmp=cdr(tmp);
+    if (val < slab->data)
+      hi = mid;
+    else if (val >= &slab->data[SLAB_SIZE])
+      lo = mid + 1;
+    else {
+      size_t index = image_slabs[mid].ordinal * SLAB_SIZE + (val - slab->data);
+      return (struct value_t*)((index + 1) << 1);
     }
-    return nil_p;
   }
 
-  if (car(val) == lambda_p) {
-    return makeproc(car(cdr(val)), cdr(cdr(val)), env);
-  }
+  die("Image refers to a cell outside of the heap");
+  return 0;
+}
 
-  if (car(val) == macroexpand_p) {
-    struct value_t* proc = eval(car(car(cdr(val))), env);
+struct value_t* image_decode(struct value_t* ref,
+                             struct memory_slab_t** slabs,
+                             size_t count) {
+  if (ref == 0 || IS_FIXNUM(ref))
+    return ref;
 
-    struct value_t* params = cdr(car(cdr(val)));
-    struct value_t* new_env = multiple_extend(env,
-                                              proc->proc.params,
-                                              params);
-    struct value_t* progn = cons(progn_p, proc->proc.body);
+  size_t index = ((uintptr_t)ref >> 1) - 1;
 
-    gc_root_push(params);
-    gc_root_push(new_env);
-    gc_root_push(progn);
+  if (index >= count * SLAB_SIZE)
+    die("Corrupted image");
 
-    struct value_t* res = eval(progn,
-                               new_env);
+  return &slabs[index / SLAB_SIZE]->data[index % SLAB_SIZE];
+}
 
-    gc_root_pop();
-    gc_root_pop();
-    gc_root_pop();
-    return res;
-  }
+size_t image_add_data_len(struct outbuf_t* data, const char* str,
+                          size_t len) {
+  size_t offset = data->size;
+
+  outbuf_write(data, str, len);
+  outbuf_write(data, "", 1);
+  return offset;
+}
 
-  struct value_t* proc = eval(car(val), env);
+size_t image_add_data(struct outbuf_t* data, const char* str) {
+  return image_add_data_len(data, str, strlen(str));
+}
 
-  if (proc->type == PRIMITIVE) {
-    struct value_t* params = eval_list(cdr(val), env);
+// Vector items and hash table entries are written to the data section
+// as encoded references.
+size_t image_add_refs(struct outbuf_t* data, struct value_t** refs,
+                      size_t count) {
+  size_t offset = data->size;
 
-    return proc->primitive_op(params);
+  for (size_t i = 0; i < count; i++) {
+    struct value_t* ref = image_encode(refs[i]);
+    outbuf_write(data, (const char*)&ref, sizeof(ref));
   }
 
-  if (proc->type == PROC) {
-    struct value_t* params = eval_list(cdr(val), env);
-    struct value_t* new_env = multiple_extend(env,
-                                              proc->proc.params,
-                                              params);
-    struct value_t* progn = cons(progn_p, proc->proc.body);
-    gc_root_push(params);
-    gc_root_push(new_env);
-    gc_root_push(progn);
+  return offset;
+}
 
-    struct value_t* res = eval(progn,
-                               new_env);
-    gc_root_pop();
-    gc_root_pop();
-    gc_root_pop();
-    return res;
+void image_encode_cell(struct value_t* cell, struct outbuf_t* data) {
+  switch(cell->type) {
+  case GUARD:
+    *cell = (struct value_t){.type = GUARD};
+    break;
+  case SYMBOL:
+    cell->symbol.name =
+      (const char*)(uintptr_t)image_add_data(data, cell->symbol.name);
+    cell->symbol.global = image_encode(cell->symbol.global);
+    break;
+  case CONS:
+    cell->cons.car = image_encode(cell->cons.car);
+    cell->cons.cdr = image_encode(cell->cons.cdr);
+    break;
+  case INT:
+    break;
+  case PROC:
+  case MACRO:
+    cell->proc.params = image_encode(cell->proc.params);
+    cell->proc.body = image_encode(cell->proc.body);
+    cell->proc.env = image_encode(cell->proc.env);
+    break;
+  case PRIMITIVE:
+    cell->int_value = cell->primitive - primitives;
+    break;
+  case STRING:
+    cell->string.block = 0;
+    cell->string.data = (const char*)(uintptr_t)image_add_data_len(
+      data, cell->string.data, cell->string.length);
+    break;
+  case VECTOR:
+    cell->vector.items = (struct value_t**)image_add_refs(
+      data, cell->vector.items, cell->vector.size);
+    break;
+  case HASH_TABLE: {
+    size_t offset = data->size;
+
+    for (size_t i = 0; i < cell->hash.capacity; i++) {
+      if (cell->hash.entries[i].key != 0)
+        image_add_refs(data, &cell->hash.entries[i].key, 2);
+    }
+
+    cell->hash.entries = (struct hash_entry_t*)offset;
+    break;
+  }
+  case CODE:
+    // Bytecode is compiled again on the first call.
+    cell->code.bytecode = 0;
+    cell->code.lambda = image_encode(cell->code.lambda);
+    cell->code.scope = image_encode(cell->code.scope);
+    break;
   }
 
-  if (proc->type == MACRO) {
-    struct value_t* params = cdr(val);
-    struct value_t* new_env = multiple_extend(env,
-                                              proc->proc.params,
-                                              params);
-    struct value_t* progn = cons(progn_p, proc->proc.body);
+  cell->gc_flag = GC_WHITE;
+}
 
-    gc_root_push(params);
-    gc_root_push(new_env);
-    gc_root_push(progn);
+void image_save(const char* filename) {
+  // Compaction leaves only live cells, packed into gc_tospace order.
+  gc_compact();
+  gc_reset_generations();
 
-    struct value_t* new_form = eval(progn,
-                                    new_env);
-    gc_root_push(new_form);
+  image_slab_count = gc_tospace_slabs;
+  image_slabs = malloc(image_slab_count * sizeof(struct image_slab_t));
+  if (image_slabs == 0)
+    die("Out of memory");
 
-    struct value_t* res = eval(new_form,
-                               env);
-    gc_root_pop();
-    gc_root_pop();
-    gc_root_pop();
-    gc_root_pop();
+  for (size_t i = 0; i < image_slab_count; i++)
+    image_slabs[i] = (struct image_slab_t){gc_tospace[i], i};
 
-    return res;
-  }
+  qsort(image_slabs, image_slab_count, sizeof(struct image_slab_t),
+        image_slab_compare);
 
-  die("Unsupported procedure type");
-  return nil_p;
-}
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL)
+    die("Error opening file '%s': %s\n", filename, strerror(errno));
 
-struct value_t* eval(struct value_t* val, struct value_t* env) {
-  if (val == nil_p)
-    return nil_p;
+  struct image_header_t header = {.magic = IMAGE_MAGIC,
+                                  .version = IMAGE_VERSION,
+                                  .value_size = sizeof(struct value_t),
+                                  .primitives = PRIMITIVE_COUNT,
+                                  .slabs = image_slab_count};
+  fwrite(&header, sizeof(header), 1, f);
 
-  if (need_gc()) {
-    collectgarbage();
+  struct outbuf_t data = {0};
+
+  for (size_t i = 0; i < gc_tospace_slabs; i++) {
+    for (size_t j = 0; j < SLAB_SIZE; j++) {
+      struct value_t cell = gc_tospace[i]->data[j];
+
+      image_encode_cell(&cell, &data);
+      fwrite(&cell, sizeof(cell), 1, f);
+    }
   }
 
-  struct value_t* tmp;
-  switch(val->type) {
-  case INT:
-    return val;
-  case SYMBOL:
-    tmp = find_in_env(val, env);
-    if (tmp == nil_p)
-      die("Unbound symbol: %s\n", val->symbol.name);
-    return cdr(tmp);
-  case STRING:
-    return val;
-  case PRIMITIVE:
-    return val;
-  case PROC:
-    return val;
-  case MACRO:
-    return val;
-  case CONS:
-    return eval_cons(val, env);
-  case GUARD:
-    die("Access to deallocated memory");
-    return nil_p;
-  };
-}
+  fwrite(data.data, 1, data.size, f);
 
-struct value_t* primitive_cons(struct value_t* val) {
-  return cons(car(val), car(cdr(val)));
-}
+  header.data_size = data.size;
+  header.toplevel_env = (uintptr_t)image_encode(toplevel_env);
+  fseek(f, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, f);
 
-struct value_t* primitive_car(struct value_t* val) {
-  return car(car(val));
-}
+  if (ferror(f) || fclose(f) != 0)
+    die("Error writing image '%s'\n", filename);
 
-struct value_t* primitive_cdr(struct value_t* val) {
-  return cdr(car(val));
+  free(data.data);
+  free(image_slabs);
+  image_slabs = 0;
+  image_slab_count = 0;
 }
 
-struct value_t* primitive_plus(struct value_t* val) {
-  long sum = 0;
+const char* image_data(const char* data, size_t size, uintptr_t offset) {
+  if (offset >= size)
+    die("Corrupted image");
 
-  for (;val!=nil_p; val=cdr(val)) {
-    if (car(val)->type != INT)
-      die("Can't add non-integer values");
+  return data + offset;
+}
 
-    sum = sum + get_int(car(val));
-  }
+// The data section isn't aligned, so references are copied out of it.
+void image_read_refs(const char* data, size_t size, uintptr_t offset,
+                     struct value_t** refs, size_t count) {
+  if (count == 0)
+    return;
 
-  return makeint(sum);
+  if (offset > size || count > (size - offset) / sizeof(struct value_t*))
+    die("Corrupted image");
+
+  memcpy(refs, data + offset, count * sizeof(struct value_t*));
 }
 
-struct value_t* primitive_minus(struct value_t* val) {
-  long sum = 0;
-  size_t count = 0;
+// Must run on an empty heap, before init_symbols().
+void image_load(const char* filename) {
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
 
-  for (;val!=nil_p; val=cdr(val), count=count+1) {
-    if (car(val)->type != INT)
-      die("Can't add non-integer values");
+  if (fd < 0)
+    die("Error opening file '%s': %s\n", filename, strerror(errno));
 
-    if (count == 0)
-      sum = sum + get_int(car(val));
-    else
-      sum = sum - get_int(car(val));
-  }
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct image_header_t))
+    die("'%s' is not a heap image\n", filename);
 
-  if (count == 1)
-    return makeint(-sum);
+  char* map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
 
-  return makeint(sum);
-}
+  if (map == MAP_FAILED)
+    die("Error mapping image '%s': %s\n", filename, strerror(errno));
 
-struct value_t* primitive_mul(struct value_t* val) {
-  long mul = 1;
+  struct image_header_t header;
+  memcpy(&header, map, sizeof(header));
 
-  for (;val!=nil_p; val=cdr(val)) {
-    if (car(val)->type != INT)
-      die("Can't multiply non-integer values");
+  if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0)
+    die("'%s' is not a heap image\n", filename);
 
-    mul = mul * get_int(car(val));
-  }
+  if (header.version != IMAGE_VERSION ||
+      header.value_size != sizeof(struct value_t) ||
+      header.primitives != PRIMITIVE_COUNT)
+    die("Image '%s' was written by a different build\n", filename);
 
-  return makeint(mul);
-}
+  size_t count = header.slabs;
+  size_t cells_size = count * SLAB_SIZE * sizeof(struct value_t);
 
-struct value_t* primitive_div(struct value_t* val) {
-  if (val == nil_p)
-    die("Need at least 1 integer to compare");
-  if (car(val)->type != INT)
-    die("Can't add non-integer values");
+  if (count == 0 ||
+      (size_t)st.st_size != sizeof(header) + cells_size + header.data_size ||
+      (header.data_size > 0 &&
+       map[sizeof(header) + cells_size + header.data_size - 1] != '\0'))
+    die("Corrupted image");
 
-  long res = get_int(car(val));
+  const struct value_t* cells = (const void*)(map + sizeof(header));
+  const char* data = map + sizeof(header) + cells_size;
 
-  for (val=cdr(val); val!=nil_p; val=cdr(val)) {
-    if (car(val)->type != INT)
-      die("Can't divide non-integer values");
+  struct memory_slab_t** slabs = malloc(count * sizeof(struct memory_slab_t*));
+  if (slabs == 0)
+    die("Out of memory");
 
-    res = res / get_int(car(val));
+  for (size_t i = 0; i < count; i++) {
+    slabs[i] = slab_new();
+    slabs[i]->parent = toplevel_slab;
+    toplevel_slab = slabs[i];
   }
 
-  return makeint(res);
-}
+  size_t live = 0;
 
+  for (size_t i = count * SLAB_SIZE; i > 0; --i) {
+    struct value_t* val = &slabs[(i-1) / SLAB_SIZE]->data[(i-1) % SLAB_SIZE];
+    *val = cells[i-1];
 
-struct value_t* primitive_equals(struct value_t* val) {
-  if (val == nil_p)
-    die("Need at least 1 integer to compare");
-  if (car(val)->type != INT)
-    die("Can't add non-integer values");
+    switch(val->type) {
+    case GUARD:
+      continue;
+    case SYMBOL: {
+      const char* name = image_data(data, header.data_size,
+                                    (uintptr_t)val->symbol.name);
 
-  long res = get_int(car(val));
+      val->symbol.name = name_arena_dup(name, strlen(name));
+      val->symbol.global = image_decode(val->symbol.global, slabs, count);
+      break;
+    }
+    case CONS:
+      val->cons.car = image_decode(val->cons.car, slabs, count);
+      val->cons.cdr = image_decode(val->cons.cdr, slabs, count);
+      break;
+    case INT:
+      break;
+    case PROC:
+    case MACRO:
+      val->proc.params = image_decode(val->proc.params, slabs, count);
+      val->proc.body = image_decode(val->proc.body, slabs, count);
+      val->proc.env = image_decode(val->proc.env, slabs, count);
+      break;
+    case PRIMITIVE:
+      if ((size_t)val->int_value >= PRIMITIVE_COUNT)
+        die("Corrupted image");
+      val->primitive = &primitives[val->int_value];
+      break;
+    case STRING: {
+      uintptr_t offset = (uintptr_t)val->string.data;
 
-  for (;val!=nil_p; val=cdr(val)) {
-    if (car(val)->type != INT)
-      die("Can't compare non-integer values");
+      if (offset >= header.data_size ||
+          val->string.length >= header.data_size - offset)
+        die("Corrupted image");
 
-    if (res != get_int(car(val)))
-      return nil_p;
-  }
+      val->string.block = string_block_new(data + offset, val->string.length);
+      val->string.data = val->string.block->data;
+      break;
+    }
+    case VECTOR: {
+      uintptr_t offset = (uintptr_t)val->vector.items;
 
-  return t_p;
-}
+      if (val->vector.size > VECTOR_MAX_SIZE)
+        die("Corrupted image");
 
+      val->vector.items = malloc(val->vector.size * sizeof(struct value_t*) + 1);
+      if (val->vector.items == 0)
+        die("Out of memory");
 
-void init_env() {
-  nil_p = slab_alloc();
-  nil_p->type = SYMBOL;
-  nil_p->symbol.name = "nil";
-  symbols = cons(nil_p, nil_p);
+      image_read_refs(data, header.data_size, offset,
+                      val->vector.items, val->vector.size);
+      for (size_t j = 0; j < val->vector.size; j++)
+        val->vector.items[j] = image_decode(val->vector.items[j], slabs, count);
+      break;
+    }
+    case HASH_TABLE:
+      // Entries are rehashed once all cells are in place, see below.
+      break;
+    case CODE:
+      val->code.bytecode = 0;
+      val->code.lambda = image_decode(val->code.lambda, slabs, count);
+      val->code.scope = image_decode(val->code.scope, slabs, count);
+      break;
+    default:
+      die("Corrupted image");
+    }
 
-  REGISTER_SYMBOL(t);
-  REGISTER_SYMBOL(quote);
-  REGISTER_SYMBOL(if);
-  REGISTER_SYMBOL(lambda);
-  REGISTER_SYMBOL(progn);
-  REGISTER_SYMBOL(setf);
-  REGISTER_SYMBOL(define);
-  REGISTER_SYMBOL(defmacro);
-  REGISTER_SYMBOL(macroexpand);
+    // Everything in the image has survived a collection, so it starts
+    // out in the old generation.
+    struct memory_slab_t* slab = slabs[(i-1) / SLAB_SIZE];
+    size_t index = (i-1) % SLAB_SIZE;
 
-  toplevel_env = cons(nil_p, nil_p);
+    BIT_WORD(slab->used, index) |= BIT_MASK(index);
+    BIT_WORD(slab->marks, index) |= BIT_MASK(index);
+    if (needs_finalize(val->type))
+      gc_set_finalize(val);
 
-  extend(toplevel_env, intern("nil"), nil_p);
-  extend(toplevel_env, intern("t"), t_p);
+    val->gc_flag = GC_WHITE;
+    live++;
+  }
 
-  extend(toplevel_env, intern("cons"), makeprimitive(primitive_cons));
-  extend(toplevel_env, intern("car"), makeprimitive(primitive_car));
-  extend(toplevel_env, intern("cdr"), makeprimitive(primitive_cdr));
-  extend(toplevel_env, intern("+"), makeprimitive(primitive_plus));
-  extend(toplevel_env, intern("-"), makeprimitive(primitive_minus));
-  extend(toplevel_env, intern("="), makeprimitive(primitive_equals));
-  extend(toplevel_env, intern("*"), makeprimitive(primitive_mul));
-  extend(toplevel_env, intern("/"), makeprimitive(primitive_div));
-}
+  slab_alloc_reset();
 
+  // Symbols are all live, so the symbol table can be rebuilt from the
+  // cells instead of being stored.
+  for (size_t i = 0; i < count * SLAB_SIZE; i++) {
+    struct value_t* val = &slabs[i / SLAB_SIZE]->data[i % SLAB_SIZE];
 
-const char* read_file(const char* filename) {
-  FILE *f = fopen(filename, "rb");
+    if (val->type != SYMBOL)
+      continue;
 
-   if (f == NULL) {
-     die("Error opening file '%s': %s\n", filename, strerror( errno ));
-   }
+    if ((symbol_table.size + 1) * 2 > symbol_table.capacity)
+      symbol_table_grow();
 
-  fseek(f, 0, SEEK_END);
-  long fsize = ftell(f);
-  fseek(f, 0, SEEK_SET);
+    size_t len = strlen(val->symbol.name);
+    size_t hash = hash_name(val->symbol.name, len);
+    struct symbol_entry_t* entry = symbol_table_slot(val->symbol.name, len,
+                                                     hash);
+    entry->hash = hash;
+    entry->symbol = val;
+    symbol_table.size++;
+  }
 
-  char *string = malloc(fsize + 1);
-  fread(string, 1, fsize, f);
-  fclose(f);
+  // Hashing a key can look at the key cell, so hash tables are only
+  // filled in after every cell has been decoded.
+  for (size_t i = 0; i < count * SLAB_SIZE; i++) {
+    struct value_t* val = &slabs[i / SLAB_SIZE]->data[i % SLAB_SIZE];
 
-  string[fsize] = 0;
+    if (val->type != HASH_TABLE)
+      continue;
 
-  return string;
-}
+    uintptr_t offset = (uintptr_t)val->hash.entries;
+    size_t size = val->hash.size;
+    size_t capacity = val->hash.capacity;
 
-struct value_t* eval_file(const char* filename) {
-  const char* str = read_file(filename);
-  struct value_t* val = read_multiple(str);
-  free((void*)str);
+    if (capacity == 0 || size * 2 > capacity ||
+        (capacity & (capacity - 1)) != 0)
+      die("Corrupted image");
 
-  struct value_t* res;
+    val->hash.entries = calloc(capacity, sizeof(struct hash_entry_t));
+    if (val->hash.entries == 0)
+      die("Out of memory");
+
+    for (size_t j = 0; j < size; j++) {
+      struct value_t* pair[2];
+
+      image_read_refs(data, header.data_size,
+                      offset + j * sizeof(pair), pair, 2);
 
-  gc_root_push(val);
-  gc_root_push(symbols);
+      struct value_t* key = image_decode(pair[0], slabs, count);
+      *hash_table_slot(val->hash.entries, capacity, key) =
+        (struct hash_entry_t){key, image_decode(pair[1], slabs, count)};
+    }
+  }
 
-  res = eval(val, toplevel_env);
+  toplevel_env = image_decode((struct value_t*)(uintptr_t)header.toplevel_env,
+                              slabs, count);
 
-  gc_root_pop();
-  gc_root_pop();
+  gc_live_cells = live;
+  cells_in_use = live;
+  gc_promoted = 0;
+  gc_update_threshold();
 
-  return res;
+  free(slabs);
+  munmap(map, st.st_size);
 }
 
 int main(int argc, char** argv) {
-  init_env();
-
   //struct value_t* v = slab_alloc();
   //slab_free(v);
 
+  start_ms = now_ms();
+
   const char* filename = 0;
+  const char* save_image = 0;
+  const char* load_image = 0;
+  const char* profile = 0;
   int verbose = 0;
 
   for (int i = 1; i<argc; i++) {
     if (strcmp(argv[i], "-v") == 0)
       verbose = 1;
+    else if (strcmp(argv[i], "--gc-growth") == 0 && i+1 < argc)
+      gc_growth = strtol(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--gc-min") == 0 && i+1 < argc)
+      gc_min_threshold = strtol(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--gc-nursery") == 0 && i+1 < argc)
+      gc_nursery_size = strtol(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--gc-compact") == 0)
+      gc_compacting = 1;
+    else if (strcmp(argv[i], "--gc-stress") == 0) {
+      gc_stress = 1;
+      gc_mark_stack_limit = GC_STRESS_MARK_STACK_LIMIT;
+    }
+    else if (strcmp(argv[i], "--gc-threads") == 0 && i+1 < argc)
+      gc_threads = strtol(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--save-image") == 0 && i+1 < argc)
+      save_image = argv[++i];
+    else if (strcmp(argv[i], "--load-image") == 0 && i+1 < argc)
+      load_image = argv[++i];
+    else if (strcmp(argv[i], "--profile") == 0 && i+1 < argc)
+      profile = argv[++i];
     else
       filename = argv[i];
   }
 
-  if (filename == 0)
-    die("Usage: lisp [-v] <filename>\n");
+  if (filename == 0 && save_image == 0)
+    die("Usage: lisp [-v] [--gc-growth PERCENT] [--gc-min CELLS] "
+        "[--gc-nursery CELLS] [--gc-compact] [--gc-stress] [--gc-threads N] "
+        "[--load-image IMAGE] [--save-image IMAGE] [--profile FILE] "
+        "<filename>\n");
+
+  if (gc_growth <= 0 || gc_min_threshold < 0 || gc_nursery_size < 0 ||
+      gc_threads < 1 || gc_threads > GC_MAX_THREADS)
+    die("Invalid gc tuning parameters\n");
+
+  for (long i = 0; i < gc_threads; i++)
+    pthread_mutex_init(&gc_markers[i].lock, 0);
 
+  gc_update_threshold();
 
-  gc_root_push(toplevel_env);
+  if (load_image) {
+    image_load(load_image);
+    init_symbols();
+  }
+  else {
+    init_env();
+    eval_file("stdlib.lisp");
+  }
+
+  startup_ms = now_ms() - start_ms;
 
-  eval_file("stdlib.lisp");
+  if (profile)
+    profile_start();
 
-  struct value_t* val = eval_file(filename);
+  // With --save-image the file is optional and only preloads more
+  // definitions into the image.
+  if (save_image) {
+    if (filename)
+      eval_file(filename);
+    image_save(save_image);
+  }
+  else {
+    struct value_t* val = eval_file(filename);
 
-  const char* res = print(val);
-  printf("%s\n", res);
-  free((void*)res);
+    print_file(stdout, val);
+    printf("\n");
+  }
 
-  collectgarbage();
+  if (profile)
+    profile_write(profile);
 
-  gc_root_pop();
+  collectgarbage_full();
 
   if (verbose) {
-    printf("memory allocations: %ld\n", number_of_allocations);
-    printf("memory used: %ld\n", memory_used());
-
+    print_json_file(stdout, runtime_stats());
+    printf("\n");
   }
 
   return 0;
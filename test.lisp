@@ -1,3 +1,17 @@
+;; Checks that don't hold are collected in failures, and printed
+;; instead of the factorial at the end.
+
+(define failures (make-hash))
+
+(defmacro check (name test)
+  (list 'if test nil (list 'hash-put 'failures (list 'quote name) t)))
+
+;; There is no eq, but hash table keys compare like it.
+(defun same (a b)
+  (let ((table (make-hash)))
+    (hash-put table a t)
+    (hash-get table b)))
+
 (define factorial
   (lambda (n)
     (if (= n 0)
@@ -6,4 +20,135 @@
       )
     ))
 
-(factorial 20)
+;; Lexical scope: a procedure runs in the environment it was created
+;; in, not in its caller's. add-five still sees the n of the
+;; make-adder call that created it after that call has returned, and
+;; the global n doesn't shadow it.
+
+(define n 100)
+
+(defun make-adder (n)
+  (lambda (x) (+ x n)))
+
+(define add-five (make-adder 5))
+
+(defun call-with-n (n f)
+  (f 1))
+
+(check closure-sees-captured-parameter (= (add-five 1) 6))
+(check closure-ignores-caller-frame (= (call-with-n 1000 add-five) 6))
+
+;; Compiled procedures: variables defined in a body are visible to the
+;; whole body, closures created before the define included.
+
+(defun parity (n)
+  (define even (lambda (n) (if (= n 0) t (odd (- n 1)))))
+  (define odd (lambda (n) (if (= n 0) nil (even (- n 1)))))
+  (even n))
+
+(check internal-define-mutual-recursion (parity 10))
+(check internal-define-mutual-recursion-odd (if (parity 7) nil t))
+
+(check rest-parameter (= (cadr ((lambda args args) 1 2 3)) 2))
+(check rest-parameter-empty (if ((lambda args args)) nil t))
+(check missing-argument-is-nil (if ((lambda (a b) b) 1) nil t))
+
+(defun shadow (x)
+  (let ((x (* x 10)))
+    (let ((y x)
+          (x 1))
+      (+ x y))))
+
+(check let-shadowing (= (shadow 2) 21))
+
+(defun make-switch ()
+  (let ((state 'off))
+    (list (lambda () (setf state on))
+          (lambda () state))))
+
+(define switch (make-switch))
+((car switch))
+
+(check setf-captured-variable (same ((cadr switch)) 'on))
+
+(defun count-down (n)
+  (if (= n 0)
+      'done
+    (count-down (- n 1))))
+
+(check deep-tail-calls (same (count-down 1000000) 'done))
+
+(defun expand-defun ()
+  (macroexpand (defun f (x) x)))
+
+(check macroexpand-in-procedure (same (car (expand-defun)) 'define))
+
+;; A procedure that has already run picks up a macro redefined after
+;; it was compiled.
+
+(defmacro scale (x) (list '* x 2))
+
+(defun use-scale (x) (scale x))
+
+(check macro-before-redefinition (= (use-scale 3) 6))
+
+(defmacro scale (x) (list '* x 3))
+
+(check macro-after-redefinition (= (use-scale 3) 9))
+
+;; Vectors
+
+(define v (make-vector 3 7))
+
+(check make-vector-length (= (vector-length v) 3))
+(check make-vector-fill (= (vector-ref v 2) 7))
+(check make-vector-empty (= (vector-length (make-vector 0 nil)) 0))
+
+(vector-set! v 0 'first)
+(vector-set! v 2 "last")
+
+(check vector-set-first (same (vector-ref v 0) 'first))
+(check vector-set-keeps-others (= (vector-ref v 1) 7))
+(check vector-set-last (same (vector-ref v 2) "last"))
+
+;; Hash tables
+
+(define h (make-hash))
+
+(check hash-get-missing (= (hash-get h 'missing 42) 42))
+(check hash-get-missing-nil (if (hash-get h 'missing) nil t))
+
+(hash-put h 'sym 1)
+(hash-put h 12 2)
+(hash-put h "str" 3)
+(hash-put h 'sym 4)
+
+(check hash-put-overwrite (= (hash-get h 'sym) 4))
+(check hash-put-overwrite-count (= (hash-count h) 3))
+(check hash-int-key (= (hash-get h (+ 10 2)) 2))
+(check hash-string-key (= (hash-get h (string-append "s" "tr")) 3))
+(check hash-substring-key (= (hash-get h (substring "a str" 2)) 3))
+(check hash-symbol-key (= (hash-get h (car '(sym))) 4))
+(check hash-string-not-symbol (= (hash-get h 'str 0) 0))
+
+(define big (+ 4611686018427387903 1))
+(hash-put h big 5)
+
+(check hash-bignum-key (= (hash-get h (+ 4611686018427387903 1)) 5))
+
+(define grow (make-hash))
+
+(defun fill (i)
+  (if (< i 1000)
+      (progn
+        (hash-put grow i (* i i))
+        (fill (+ i 1)))))
+
+(fill 0)
+
+(check hash-grow-count (= (hash-count grow) 1000))
+(check hash-grow-lookup (= (hash-get grow 999) 998001))
+
+(if (= (hash-count failures) 0)
+    (factorial 20)
+  failures)
@@ -0,0 +1,44 @@
+;; Deep structures for the collector: a list nested a million levels
+;; deep through its cars, and a chain of 200,000 closures, each of
+;; which holds the previous one in its environment. Collections are
+;; forced while both are live, with a small nursery and a low full
+;; collection threshold, so marking has to follow both to the bottom.
+
+(define depth 1000000)
+(define chain-length 200000)
+
+(gc-tune 100 1000 1000)
+
+(defun nest (n acc)
+  (if (= n 0)
+      acc
+    (nest (- n 1) (cons acc nil))))
+
+(defun chain (n prev)
+  (if (= n 0)
+      prev
+    (chain (- n 1) (lambda () prev))))
+
+(define deep (nest depth 'bottom))
+(define closures (chain chain-length nil))
+
+(defun churn (n)
+  (if (= n 0)
+      t
+    (progn
+      (cons n n)
+      (churn (- n 1)))))
+
+(churn 100000)
+
+(defun bottom (x n)
+  (if (= n 0)
+      x
+    (bottom (car x) (- n 1))))
+
+(defun unwind (f n)
+  (if f
+      (unwind (f) (+ n 1))
+    n))
+
+(list (bottom deep depth) (= (unwind closures 0) chain-length))
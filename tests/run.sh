@@ -0,0 +1,173 @@
+#!/bin/sh
+# Runs test.lisp and the error checks below, and reports every case
+# whose output differs from what is expected.
+#
+# Usage: tests/run.sh [-l LISP] [-s ITERATIONS]
+#
+#   -l LISP        interpreter binary (default ./lisp)
+#   -s ITERATIONS  string soak iterations (default 100000). Each one
+#                  allocates two strings, so -s 50000000 is 100M
+
+cd "$(dirname "$0")/.."
+
+lisp=./lisp
+soak=100000
+
+while getopts l:s: opt; do
+  case $opt in
+    l) lisp=$OPTARG ;;
+    s) soak=$OPTARG ;;
+    *) exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+failed=0
+
+# expect NAME EXPECTED [FLAGS...] FILE
+#
+# Runs the interpreter and compares its output with EXPECTED. Errors
+# are printed to stdout too, so a program that is expected to fail is
+# checked the same way.
+expect() {
+  name=$1
+  expected=$2
+  shift 2
+
+  "$lisp" "$@" > "$tmp/out" 2>&1
+  actual=$(cat "$tmp/out")
+
+  if [ "$actual" = "$expected" ]; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"
+    echo "  expected: $expected"
+    echo "  actual:   $(head -c 300 "$tmp/out")"
+    failed=$((failed + 1))
+  fi
+}
+
+# expect_file NAME EXPECTED_FILE [FLAGS...] FILE
+#
+# Like expect, for output that is too big to spell out.
+expect_file() {
+  name=$1
+  expected=$2
+  shift 2
+
+  "$lisp" "$@" > "$tmp/out" 2>&1
+
+  if cmp -s "$tmp/out" "$expected"; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"
+    echo "  output differs from $expected"
+    failed=$((failed + 1))
+  fi
+}
+
+# expect_program NAME EXPECTED [FLAGS...] -- SOURCE
+expect_program() {
+  name=$1
+  expected=$2
+  shift 2
+
+  flags=
+  while [ "$1" != -- ]; do
+    flags="$flags $1"
+    shift
+  done
+
+  printf '%s\n' "$2" > "$tmp/program.lisp"
+  expect "$name" "$expected" $flags "$tmp/program.lisp"
+}
+
+factorial=2432902008176640000
+
+expect test.lisp $factorial test.lisp
+expect "test.lisp --gc-stress" $factorial --gc-stress test.lisp
+expect "test.lisp --gc-compact" $factorial --gc-compact test.lisp
+# Stress mode collects at every safe point. It has to stay linear in
+# the number of allocations to be usable on more than toy programs.
+sed 's/(loop 200000 0)/(loop 2000 0)/' bench/let.lisp > "$tmp/let.lisp"
+expect "let loop --gc-stress" 4002000 --gc-stress "$tmp/let.lisp"
+
+# A million-deep car nest and a 200,000 closure chain, collected while
+# live. Under --gc-stress every safe point is a collection over the
+# whole live heap, so that run uses the same script at a depth of 200.
+expect gc-deep "(bottom t)" tests/gc-deep.lisp
+expect "gc-deep --gc-threads 4" "(bottom t)" --gc-threads 4 tests/gc-deep.lisp
+sed -e 's/(define depth 1000000)/(define depth 200)/' \
+    -e 's/(define chain-length 200000)/(define chain-length 200)/' \
+    -e 's/(churn 100000)/(churn 200)/' tests/gc-deep.lisp > "$tmp/gc-deep.lisp"
+expect "gc-deep --gc-stress" "(bottom t)" --gc-stress "$tmp/gc-deep.lisp"
+
+# Collected strings give their storage back, so RSS stays flat.
+sed "s/(define iterations 100000)/(define iterations $soak)/" \
+  tests/string-soak.lisp > "$tmp/string-soak.lisp"
+expect "string-soak $soak" flat "$tmp/string-soak.lisp"
+
+expect save-image "" --save-image "$tmp/stdlib.img"
+expect "test.lisp --load-image" $factorial --load-image "$tmp/stdlib.img" test.lisp
+
+# A million nested lists and a million nested quotes. The reader keeps
+# open lists on the heap, so neither depth touches the C stack.
+awk 'BEGIN {
+  printf "(quote "
+  for (i = 0; i < 1000000; i++) printf "("
+  printf "x"
+  for (i = 0; i < 1000000; i++) printf ")"
+  printf ")\n"
+  for (i = 0; i < 1000000; i++) printf "\047"
+  printf "x\n"
+  printf "(quote done)\n"
+}' > "$tmp/deep.lisp"
+expect reader-deep-nesting done "$tmp/deep.lisp"
+
+# The printer doesn't recurse either.
+awk 'BEGIN {
+  for (i = 0; i < 1000000; i++) printf "("
+  printf "x"
+  for (i = 0; i < 1000000; i++) printf " (y))"
+  printf "\n"
+}' > "$tmp/nested.txt"
+{ printf "(quote "; cat "$tmp/nested.txt"; printf ")\n"; } > "$tmp/nested.lisp"
+expect_file printer-deep-nesting "$tmp/nested.txt" "$tmp/nested.lisp"
+
+expect_program reader-unbalanced "Unexpected ')'" -- "'(a))"
+expect_program reader-unterminated "Malformed list" -- '(a (b)'
+expect_program reader-quote-at-end "Unexpected end of input after quote" -- \
+  "'(a) '"
+
+# Non-tail recursion keeps one VM frame per level, and the fixnum
+# fast path in the tail position of a body must not return twice.
+expect_program deep-recursion 20000 -- \
+  '(defun f (n) (if (= n 0) 0 (+ 1 (f (- n 1))))) (f 20000)'
+
+expect_program macro-after-compile 1 -- \
+  '(defun f (x) (if x (later 1) 0)) (f nil) (defmacro later (a) a) (f t)'
+expect_program macro-defined-while-running \
+  "Macro later was defined while a procedure using it was running" -- \
+  '(defun f () (defmacro later (a) a) (later 1)) (f)'
+expect_program local-before-define "Unbound symbol: b" -- \
+  '(defun g () (define a b) (define b 1) a) (g)'
+
+expect_program vector-ref-negative "Vector index out of range: -1" -- \
+  '(vector-ref (make-vector 2 0) -1)'
+expect_program vector-ref-past-end "Vector index out of range: 2" -- \
+  '(vector-ref (make-vector 2 0) 2)'
+expect_program vector-set-past-end "Vector index out of range: 3" -- \
+  '(vector-set! (make-vector 3 0) 3 1)'
+expect_program make-vector-negative "make-vector expects a non-negative size" -- \
+  '(make-vector -1 0)'
+expect_program make-vector-overflow \
+  "make-vector: size too large: 2305843009213693952" -- \
+  '(make-vector 2305843009213693952 0)'
+
+if [ $failed -gt 0 ]; then
+  echo "$failed failed"
+  exit 1
+fi
@@ -0,0 +1,30 @@
+;; Allocates strings in a loop and checks that the maximum RSS stays
+;; where it was after a warm-up. Every iteration makes two strings, a
+;; string-append and a substring of it, and drops both. The string heap
+;; only settles after a few collections, which is what the warm-up is
+;; for. Prints flat, or the two RSS figures in bytes if it grew by more
+;; than a megabyte.
+
+(define warm-up 100000)
+(define iterations 100000)
+
+(defun stat (name)
+  (let ((table (make-hash)))
+    (map (lambda (pair) (hash-put table (car pair) (cdr pair)))
+         (runtime-stats))
+    (hash-get table name)))
+
+(defun soak (n s)
+  (if (= n 0)
+      s
+    (soak (- n 1) (substring (string-append s "abcdefgh") 8))))
+
+(soak warm-up "01234567")
+(define before (stat 'max-rss-bytes))
+
+(soak iterations "01234567")
+(define after (stat 'max-rss-bytes))
+
+(if (< (- after before) 1048576)
+    'flat
+  (list before after))